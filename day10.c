@@ -4,6 +4,9 @@
 #include <stdlib.h>
 
 #include "aoc.h"
+#include "types.h"
+
+#define DAY10_CRT_WIDTH 40
 
 typedef enum {
 	INST_TYPE_NOOP,
@@ -18,8 +21,50 @@ typedef struct {
 typedef struct {
 	Instruction *instructions;
 	int count;
+
+	// Value of register X during each cycle, trace[0] is cycle 1
+	int *trace;
+	int cycle_count;
 } day10_Data;
 
+// Runs the program once, recording X for every cycle. addx takes two cycles
+// and X only changes after both of them.
+static void day10_compile_trace(day10_Data *data)
+{
+	data->cycle_count = 0;
+	for (int i = 0; i < data->count; i++) {
+		data->cycle_count += data->instructions[i].type == INST_TYPE_ADD ? 2 : 1;
+	}
+
+	data->trace = malloc(data->cycle_count * sizeof(int));
+	int regx = 1;
+	int cycle = 0;
+	for (int i = 0; i < data->count; i++) {
+		Instruction *inst = &data->instructions[i];
+		data->trace[cycle++] = regx;
+		if (inst->type == INST_TYPE_ADD) {
+			data->trace[cycle++] = regx;
+			regx += inst->amount;
+		}
+	}
+}
+
+static int day10_regx_at(day10_Data *data, int cycle)
+{
+	return data->trace[cycle-1];
+}
+
+// Sum of cycle * X over the given cycles, cycles past the end of the program are skipped
+static long day10_signal_strength(day10_Data *data, int *cycles, int count)
+{
+	long result = 0;
+	for (int i = 0; i < count; i++) {
+		if (cycles[i] < 1 || cycles[i] > data->cycle_count) continue;
+		result += (long)cycles[i] * day10_regx_at(data, cycles[i]);
+	}
+	return result;
+}
+
 static void *day10_parse(char **lines, int line_count)
 {
 	day10_Data *data = malloc(sizeof(day10_Data));
@@ -37,6 +82,7 @@ static void *day10_parse(char **lines, int line_count)
 		}
 	}
 
+	day10_compile_trace(data);
 	return data;
 }
 
@@ -44,83 +90,93 @@ static void day10_part1(void *p)
 {
 	day10_Data *data = p;
 
-	int regx = 1;
-	int result = 0;
-	int inst_idx = 0;
-	int cycle = 0;
-	int add_timer = 0;
-	bool add_started = false;
-	while (inst_idx < data->count) {
-		Instruction *inst = &data->instructions[inst_idx];
-		if (!add_started) {
-			if (inst->type == INST_TYPE_NOOP) {
-				inst_idx++;
-			} else if (inst->type == INST_TYPE_ADD) {
-				add_started = true;
-				add_timer = 2;
-			}
-		}
+	int cycles[] = { 20, 60, 100, 140, 180, 220 };
+	printf("%ld\n", day10_signal_strength(data, cycles, ARRAY_LEN(cycles)));
+}
 
-		cycle++;
+// Renders the CRT into `framebuffer` as text rows of `width` pixels ending in
+// '\n'. Needs room for day10_row_count(data, width) * (width+1) bytes.
+static int day10_row_count(day10_Data *data, int width)
+{
+	return (data->cycle_count + width - 1) / width;
+}
 
-		if ((cycle - 20) % 40 == 0 && cycle <= 220) {
-			result += cycle*regx;
-		}
+static void day10_render(day10_Data *data, int width, char *framebuffer)
+{
+	int rows = day10_row_count(data, width);
+	memset(framebuffer, '.', rows * (width+1));
+	for (int y = 0; y < rows; y++) {
+		framebuffer[y * (width+1) + width] = '\n';
+	}
 
-		if (add_started) {
-			add_timer--;
-			if (add_timer == 0) {
-				add_started = false;
-				regx += inst->amount;
-				inst_idx++;
-			}
+	for (int cycle = 0; cycle < data->cycle_count; cycle++) {
+		int x = cycle % width;
+		if (abs(x - data->trace[cycle]) <= 1) {
+			framebuffer[(cycle / width) * (width+1) + x] = '#';
 		}
 	}
-
-	printf("%d\n", result);
 }
 
-static void day10_part2(void *p)
+// Letters are 4x6 pixels with one column of spacing. Each glyph is encoded as
+// 24 bits, 4 per row, top row in the highest bits.
+#define DAY10_GLYPH_WIDTH 4
+#define DAY10_GLYPH_HEIGHT 6
+#define DAY10_GLYPH_STRIDE 5
+
+static const struct {
+	u32 bits;
+	char letter;
+} day10_glyphs[] = {
+	{ 0x699F99, 'A' }, { 0xE9E99E, 'B' }, { 0x698896, 'C' }, { 0xF8E88F, 'E' },
+	{ 0xF8E888, 'F' }, { 0x698B97, 'G' }, { 0x99F999, 'H' }, { 0x722227, 'I' },
+	{ 0x311196, 'J' }, { 0x9ACAA9, 'K' }, { 0x88888F, 'L' }, { 0x699996, 'O' },
+	{ 0xE99E88, 'P' }, { 0xE99EA9, 'R' }, { 0x78861E, 'S' }, { 0x999996, 'U' },
+	{ 0xF1248F, 'Z' },
+};
+
+// Decodes the letters drawn in a rendered framebuffer, unknown glyphs become '?'.
+// `result` needs room for width / DAY10_GLYPH_STRIDE + 1 chars.
+static void day10_ocr(const char *framebuffer, int width, char *result)
 {
-	day10_Data *data = p;
-
-	int regx = 1;
-	int inst_idx = 0;
-	int cycle = 0;
-	int add_timer = 0;
-	bool add_started = false;
-	while (inst_idx < data->count) {
-		Instruction *inst = &data->instructions[inst_idx];
-		if (!add_started) {
-			if (inst->type == INST_TYPE_NOOP) {
-				inst_idx++;
-			} else if (inst->type == INST_TYPE_ADD) {
-				add_started = true;
-				add_timer = 2;
+	int letter_count = (width + DAY10_GLYPH_STRIDE - DAY10_GLYPH_WIDTH) / DAY10_GLYPH_STRIDE;
+	for (int i = 0; i < letter_count; i++) {
+		u32 bits = 0;
+		for (int y = 0; y < DAY10_GLYPH_HEIGHT; y++) {
+			for (int x = 0; x < DAY10_GLYPH_WIDTH; x++) {
+				char pixel = framebuffer[y * (width+1) + i * DAY10_GLYPH_STRIDE + x];
+				bits = (bits << 1) | (pixel == '#');
 			}
 		}
 
-		if (abs(cycle % 40 - regx) <= 1) {
-			printf("#");
-		} else {
-			printf(".");
-		}
-
-		cycle++;
-
-		if (add_started) {
-			add_timer--;
-			if (add_timer == 0) {
-				add_started = false;
-				regx += inst->amount;
-				inst_idx++;
+		result[i] = '?';
+		for (int j = 0; j < ARRAY_LEN(day10_glyphs); j++) {
+			if (day10_glyphs[j].bits == bits) {
+				result[i] = day10_glyphs[j].letter;
+				break;
 			}
 		}
+	}
+	result[letter_count] = '\0';
+}
 
-		if (cycle % 40 == 0) {
-			printf("\n");
-		}
+static void day10_part2(void *p)
+{
+	day10_Data *data = p;
+
+	int width = DAY10_CRT_WIDTH;
+	int rows = day10_row_count(data, width);
+	size_t size = rows * (width+1);
+	char *framebuffer = malloc(size);
+	day10_render(data, width, framebuffer);
+	fwrite(framebuffer, 1, size, stdout);
+
+	if (rows == DAY10_GLYPH_HEIGHT) {
+		char letters[width / DAY10_GLYPH_STRIDE + 1];
+		day10_ocr(framebuffer, width, letters);
+		printf("%s\n", letters);
 	}
+
+	free(framebuffer);
 }
 
 ADD_SOLUTION(10, day10_parse, day10_part1, day10_part2);
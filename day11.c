@@ -3,8 +3,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
 
 #include "aoc.h"
+#include "types.h"
+
+// Finding an item's cycle walks its prefix and cycle several times, so below
+// this many rounds simulating them all in batches is faster
+#define DAY11_MIN_CYCLE_ROUNDS 20000
 
 typedef enum {
 	MONKEY_OP_ADD,
@@ -60,17 +68,263 @@ static void parse_operation(char *operation, MONKEY_OP *op, int *op_value)
 	}
 }
 
-static inline void apply_operation(uint64_t *value, MONKEY_OP op, int op_value)
+// Applies a monkey's operation to its whole batch of items at once,
+// with the switch hoisted out so every case is a plain loop. No worry is
+// larger than the OR of all of them, so a single check of that against the
+// operation's bound rules out overflow for the whole batch and the loops
+// carry no per-item check. Only the add loop vectorizes, SSE2 has no 64-bit
+// multiply. If the bound check fails, the items are checked one by one, and
+// worry that doesn't fit into 64 bits aborts instead of wrapping around.
+static void apply_operation_batch(uint64_t *items, size_t count, MONKEY_OP op, int op_value)
 {
+	uint64_t bits = 0;
+	for (size_t i = 0; i < count; i++) {
+		bits |= items[i];
+	}
+
+	bool overflow = false;
 	switch (op) {
 	case MONKEY_OP_ADD:
-		*value += op_value;
+		if (bits <= UINT64_MAX - op_value) {
+			for (size_t i = 0; i < count; i++) {
+				items[i] += op_value;
+			}
+		} else {
+			for (size_t i = 0; i < count; i++) {
+				overflow |= __builtin_add_overflow(items[i], op_value, &items[i]);
+			}
+		}
 		break;
 	case MONKEY_OP_MUL:
-		*value *= op_value;
+		if (op_value == 0 || bits <= UINT64_MAX / op_value) {
+			for (size_t i = 0; i < count; i++) {
+				items[i] *= op_value;
+			}
+		} else {
+			for (size_t i = 0; i < count; i++) {
+				overflow |= __builtin_mul_overflow(items[i], op_value, &items[i]);
+			}
+		}
 		break;
 	case MONKEY_OP_SQR:
-		*value *= *value;
+		if (bits <= UINT32_MAX) {
+			for (size_t i = 0; i < count; i++) {
+				items[i] *= items[i];
+			}
+		} else {
+			for (size_t i = 0; i < count; i++) {
+				overflow |= __builtin_mul_overflow(items[i], items[i], &items[i]);
+			}
+		}
+		break;
+	default:
+		printf("abort: %d\n", op);
+		fflush(stdout);
+		abort();
+	}
+
+	if (overflow) {
+		fprintf(stderr, "Worry level doesn't fit into 64 bits\n");
+		abort();
+	}
+}
+
+// Division-free divisibility test. With d = odd * 2^shift, n is divisible
+// by d exactly when n * odd^-1 (mod 2^64), rotated right by `shift`, is at
+// most (2^64-1) / d. For n below 2^32 the same works in 32 bits, with the
+// low half of the inverse.
+typedef struct {
+	uint64_t inverse;
+	uint64_t limit;
+	uint32_t inverse32;
+	uint32_t limit32;
+	int shift;
+} day11_Divisor;
+
+static day11_Divisor day11_divisor(uint64_t d)
+{
+	day11_Divisor divisor;
+	divisor.shift = __builtin_ctzll(d);
+	uint64_t odd = d >> divisor.shift;
+
+	// Newton's iteration, every step doubles the number of correct bits
+	uint64_t inverse = odd;
+	for (int i = 0; i < 5; i++) {
+		inverse *= 2 - odd * inverse;
+	}
+	divisor.inverse = inverse;
+	divisor.limit = UINT64_MAX / d;
+	divisor.inverse32 = inverse;
+	divisor.limit32 = UINT32_MAX / d;
+	return divisor;
+}
+
+static inline bool day11_is_divisible(uint64_t n, day11_Divisor divisor)
+{
+	uint64_t q = n * divisor.inverse;
+	if (divisor.shift > 0) {
+		q = (q >> divisor.shift) | (q << (64 - divisor.shift));
+	}
+	return q <= divisor.limit;
+}
+
+// Tests a whole batch, `narrow` if all items are below 2^32. Only then the
+// loop vectorizes, 64-bit multiplies don't.
+static void day11_test_batch(const uint64_t *items, size_t count, day11_Divisor divisor, bool narrow, bool *divisible)
+{
+	if (narrow) {
+		uint32_t inverse = divisor.inverse32;
+		uint32_t limit = divisor.limit32;
+		int shift = divisor.shift;
+		for (size_t i = 0; i < count; i++) {
+			uint32_t q = (uint32_t)items[i] * inverse;
+			q = (q >> shift) | (q << ((32 - shift) & 31));
+			divisible[i] = q <= limit;
+		}
+	} else {
+		for (size_t i = 0; i < count; i++) {
+			divisible[i] = day11_is_divisible(items[i], divisor);
+		}
+	}
+}
+
+// Worry is kept modulo the LCM of all tests and reduced with Barrett
+// reduction, no division is left in the hot loop.
+// Below 2^30, worry fits into 32 bits and a product of two into 64. For a
+// `bits`-bit m, with mu = floor(4^bits / m), the quotient
+// ((x >> (bits-1)) * mu) >> (bits+1) is off by at most 2, so the remainder
+// stays below 3m < 2^32. That takes only 32x32 bit multiplies into 64 bits,
+// shifts and compares, which SSE2 has, so the batch loops vectorize.
+// Larger moduli are handled in 128 bits, where even squaring can't overflow:
+// `factor` = floor((2^128-1) / m), so the quotient is the high half of
+// x * factor, again off by at most 2.
+typedef struct {
+	uint64_t m;
+	u128 factor;
+	uint32_t mu;
+	int bits; // 0 if m doesn't fit into 30 bits
+} day11_Modulus;
+
+static uint64_t day11_gcd(uint64_t a, uint64_t b)
+{
+	while (b != 0) {
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static day11_Modulus day11_modulus(day11_Data *data)
+{
+	uint64_t lcm = 1;
+	for (int i = 0; i < data->count; i++) {
+		uint64_t test = data->monkeys[i].test_value;
+		if (__builtin_mul_overflow(lcm / day11_gcd(lcm, test), test, &lcm)) {
+			fprintf(stderr, "LCM of monkey tests doesn't fit into 64 bits\n");
+			abort();
+		}
+	}
+
+	day11_Modulus modulus = { .m = lcm };
+	modulus.factor = lcm > 1 ? ~(u128)0 / lcm : 0;
+	if (lcm < (1 << 30)) {
+		modulus.bits = 64 - __builtin_clzll(lcm);
+		modulus.mu = (1ull << (2 * modulus.bits)) / lcm;
+	}
+	return modulus;
+}
+
+// High 128 bits of a 128x128 bit product
+static inline u128 day11_mulhi128(u128 a, u128 b)
+{
+	uint64_t a_lo = a, a_hi = a >> 64;
+	uint64_t b_lo = b, b_hi = b >> 64;
+	u128 lo_lo = (u128)a_lo * b_lo;
+	u128 hi_lo = (u128)a_hi * b_lo;
+	u128 lo_hi = (u128)a_lo * b_hi;
+	u128 hi_hi = (u128)a_hi * b_hi;
+	u128 middle = (lo_lo >> 64) + (uint64_t)hi_lo + (uint64_t)lo_hi;
+	return hi_hi + (hi_lo >> 64) + (lo_hi >> 64) + (middle >> 64);
+}
+
+static inline uint64_t day11_reduce(u128 x, day11_Modulus *modulus)
+{
+	if (modulus->m == 1) return 0;
+
+	u128 q = day11_mulhi128(x, modulus->factor);
+	u128 r = x - q * modulus->m;
+	while (r >= modulus->m) {
+		r -= modulus->m;
+	}
+	return r;
+}
+
+static inline uint32_t day11_reduce32(uint64_t x, uint32_t m, uint32_t mu, int bits)
+{
+	uint32_t q = ((uint64_t)(uint32_t)(x >> (bits - 1)) * mu) >> (bits + 1);
+	uint32_t r = (uint32_t)x - q * m;
+	r = r >= m ? r - m : r;
+	r = r >= m ? r - m : r;
+	return r;
+}
+
+static void apply_operation_mod32_batch(uint64_t *items, size_t count, MONKEY_OP op, int op_value, day11_Modulus *modulus)
+{
+	uint32_t m = modulus->m;
+	uint32_t mu = modulus->mu;
+	int bits = modulus->bits;
+	uint32_t value = op == MONKEY_OP_SQR ? 0 : op_value % m;
+
+	switch (op) {
+	case MONKEY_OP_ADD:
+		for (size_t i = 0; i < count; i++) {
+			uint32_t r = (uint32_t)items[i] + value;
+			items[i] = r >= m ? r - m : r;
+		}
+		break;
+	case MONKEY_OP_MUL:
+		for (size_t i = 0; i < count; i++) {
+			items[i] = day11_reduce32((uint64_t)(uint32_t)items[i] * value, m, mu, bits);
+		}
+		break;
+	case MONKEY_OP_SQR:
+		for (size_t i = 0; i < count; i++) {
+			uint32_t item = items[i];
+			items[i] = day11_reduce32((uint64_t)item * item, m, mu, bits);
+		}
+		break;
+	default:
+		printf("abort: %d\n", op);
+		fflush(stdout);
+		abort();
+	}
+}
+
+// Same as apply_operation_batch, but every result is reduced modulo
+// `modulus`. All items have to be reduced already.
+static void apply_operation_mod_batch(uint64_t *items, size_t count, MONKEY_OP op, int op_value, day11_Modulus *modulus)
+{
+	if (modulus->bits > 0) {
+		apply_operation_mod32_batch(items, count, op, op_value, modulus);
+		return;
+	}
+
+	switch (op) {
+	case MONKEY_OP_ADD:
+		for (size_t i = 0; i < count; i++) {
+			items[i] = day11_reduce((u128)items[i] + op_value, modulus);
+		}
+		break;
+	case MONKEY_OP_MUL:
+		for (size_t i = 0; i < count; i++) {
+			items[i] = day11_reduce((u128)items[i] * op_value, modulus);
+		}
+		break;
+	case MONKEY_OP_SQR:
+		for (size_t i = 0; i < count; i++) {
+			items[i] = day11_reduce((u128)items[i] * items[i], modulus);
+		}
 		break;
 	default:
 		printf("abort: %d\n", op);
@@ -102,86 +356,327 @@ static void *day11_parse(char **lines, int line_count)
 	return data;
 }
 
-static uint64_t solve(day11_Data *data, int rounds, bool reduce_worry)
+// Product of the two highest inspection counts
+static u128 day11_monkey_business(uint64_t *inspections, int monkey_count)
+{
+	uint64_t top_inspection1 = 0;
+	uint64_t top_inspection2 = 0;
+	for (int i = 0; i < monkey_count; i++) {
+		if (inspections[i] > top_inspection1) {
+			top_inspection2 = top_inspection1;
+			top_inspection1 = inspections[i];
+		} else if (inspections[i] > top_inspection2) {
+			top_inspection2 = inspections[i];
+		}
+	}
+
+	return (u128)top_inspection1 * top_inspection2;
+}
+
+static u128 solve(day11_Data *data, int rounds, bool reduce_worry)
 {
 	int monkey_count = data->count;
 
-	int inspections[monkey_count];
+	uint64_t inspections[monkey_count];
 	for (int i = 0; i < data->count; i++) {
 		inspections[i] = 0;
 	}
 
-	int total_item_count = 0;
+	size_t total_item_count = 0;
 	for (int i = 0; i < monkey_count; i++) {
 		total_item_count += data->monkeys[i].item_count;
 	}
 
-	size_t items[monkey_count][total_item_count];
+	// A monkey always throws away every item it holds during its turn, so
+	// each queue is drained completely before it gets refilled and a flat
+	// buffer per monkey, big enough for all items, is all that's needed
+	uint64_t *storage = malloc((size_t)monkey_count * total_item_count * sizeof(uint64_t));
+	bool *divisible = malloc(total_item_count * sizeof(bool));
+	uint64_t *items[monkey_count];
 	size_t item_counts[monkey_count];
 	for (int i = 0; i < monkey_count; i++) {
 		Monkey *monkey = &data->monkeys[i];
+		items[i] = storage + (size_t)i * total_item_count;
 		item_counts[i] = monkey->item_count;
 		for (int j = 0; j < monkey->item_count; j++) {
 			items[i][j] = monkey->items[j];
 		}
 	}
 
-	int modulo = 1;
+	day11_Divisor tests[monkey_count];
 	for (int i = 0; i < monkey_count; i++) {
-		modulo *= data->monkeys[i].test_value;
+		tests[i] = day11_divisor(data->monkeys[i].test_value);
+	}
+
+	// Dividing by 3 keeps worry small without it, and the LCM might not fit
+	day11_Modulus modulus;
+	bool narrow = false;
+	if (!reduce_worry) {
+		modulus = day11_modulus(data);
+		narrow = modulus.bits > 0;
+		for (int i = 0; i < monkey_count; i++) {
+			for (size_t j = 0; j < item_counts[i]; j++) {
+				items[i][j] = day11_reduce(items[i][j], &modulus);
+			}
+		}
 	}
 
 	for (int round = 1; round <= rounds; round++) {
 		for (int i = 0; i < monkey_count; i++) {
 			Monkey *monkey = &data->monkeys[i];
-			for (int j = 0; j < item_counts[i]; j++) {
-				uint64_t item_worry = items[i][j];
-				apply_operation(&item_worry, monkey->op, monkey->op_value);
-				if (reduce_worry) {
-					item_worry /= 3;
-				} else {
-					item_worry %= modulo;
-				}
+			uint64_t *batch = items[i];
+			size_t count = item_counts[i];
 
-				int target_monkey;
-				if (item_worry % monkey->test_value == 0) {
-					target_monkey = monkey->test_true;
-				} else {
-					target_monkey = monkey->test_false;
+			if (reduce_worry) {
+				apply_operation_batch(batch, count, monkey->op, monkey->op_value);
+				for (size_t j = 0; j < count; j++) {
+					batch[j] /= 3;
 				}
+			} else {
+				apply_operation_mod_batch(batch, count, monkey->op, monkey->op_value, &modulus);
+			}
 
-				items[target_monkey][item_counts[target_monkey]++] = item_worry;
+			// Throwing the items is a scatter, which stays scalar
+			day11_test_batch(batch, count, tests[i], narrow, divisible);
+			for (size_t j = 0; j < count; j++) {
+				int target_monkey = divisible[j] ? monkey->test_true : monkey->test_false;
+				items[target_monkey][item_counts[target_monkey]++] = batch[j];
 			}
 
-			inspections[i] += item_counts[i];
+			inspections[i] += count;
 			item_counts[i] = 0;
 		}
+	}
+	free(storage);
+	free(divisible);
 
+	return day11_monkey_business(inspections, monkey_count);
+}
+
+// With worry kept modulo the LCM of all tests, items never affect each
+// other. An item's state at the start of a round is (monkey, worry), and one
+// round maps it to the next state deterministically: it is thrown onwards
+// within the same round while the target monkey comes later in the order.
+// Every item therefore ends up in a cycle, and inspection counts for any
+// number of rounds are extrapolated from the prefix and one pass of the cycle.
+typedef struct {
+	int monkey;
+	uint64_t worry;
+} day11_ItemState;
+
+typedef struct {
+	day11_Data *data;
+	day11_Divisor *tests;
+	day11_Modulus modulus;
+	uint64_t rounds;
+
+	day11_ItemState *items;
+	size_t item_count;
+	size_t next_item;
+} day11_IndependentRun;
+
+typedef struct {
+	day11_IndependentRun *run;
+	pthread_t thread;
+	uint64_t *inspections;
+} day11_ItemWorker;
+
+static inline bool day11_state_eq(day11_ItemState a, day11_ItemState b)
+{
+	return a.monkey == b.monkey && a.worry == b.worry;
+}
+
+// Simulates one round for a single item, `inspections` may be NULL
+static day11_ItemState day11_item_round(day11_IndependentRun *run, day11_ItemState state, uint64_t *inspections)
+{
+	int monkey = state.monkey;
+	uint64_t worry = state.worry;
+	while (true) {
+		Monkey *m = &run->data->monkeys[monkey];
+		if (inspections) {
+			inspections[monkey]++;
+		}
+
+		apply_operation_mod_batch(&worry, 1, m->op, m->op_value, &run->modulus);
+
+		int target = day11_is_divisible(worry, run->tests[monkey]) ? m->test_true : m->test_false;
+		if (target <= monkey) {
+			return (day11_ItemState){ target, worry };
+		}
+		monkey = target;
 	}
+}
 
-	uint64_t top_inspection1 = 0;
-	uint64_t top_inspection2 = 0;
+static day11_ItemState day11_item_rounds(day11_IndependentRun *run, day11_ItemState state, uint64_t rounds, uint64_t *inspections)
+{
+	for (uint64_t i = 0; i < rounds; i++) {
+		state = day11_item_round(run, state, inspections);
+	}
+	return state;
+}
+
+// Adds one item's inspections over `run->rounds` rounds into `inspections`
+static void day11_track_item(day11_IndependentRun *run, day11_ItemState start, uint64_t *inspections)
+{
+	int monkey_count = run->data->count;
+
+	// Brent's cycle detection. If no cycle shows up within the requested
+	// number of rounds, simulating them directly is cheaper anyway.
+	uint64_t power = 1, cycle_length = 1, steps = 1;
+	day11_ItemState tortoise = start;
+	day11_ItemState hare = day11_item_round(run, start, NULL);
+	while (!day11_state_eq(tortoise, hare)) {
+		if (steps > run->rounds) {
+			day11_item_rounds(run, start, run->rounds, inspections);
+			return;
+		}
+		if (power == cycle_length) {
+			tortoise = hare;
+			power *= 2;
+			cycle_length = 0;
+		}
+		hare = day11_item_round(run, hare, NULL);
+		cycle_length++;
+		steps++;
+	}
+
+	uint64_t cycle_start = 0;
+	tortoise = start;
+	hare = day11_item_rounds(run, start, cycle_length, NULL);
+	while (!day11_state_eq(tortoise, hare)) {
+		tortoise = day11_item_round(run, tortoise, NULL);
+		hare = day11_item_round(run, hare, NULL);
+		cycle_start++;
+	}
+
+	if (run->rounds <= cycle_start + cycle_length) {
+		day11_item_rounds(run, start, run->rounds, inspections);
+		return;
+	}
+
+	day11_ItemState state = day11_item_rounds(run, start, cycle_start, inspections);
+
+	uint64_t cycle_inspections[monkey_count];
+	memset(cycle_inspections, 0, sizeof(cycle_inspections));
+	day11_item_rounds(run, state, cycle_length, cycle_inspections);
+
+	uint64_t remaining = run->rounds - cycle_start;
+	uint64_t cycle_count = remaining / cycle_length;
 	for (int i = 0; i < monkey_count; i++) {
-		if (inspections[i] > top_inspection1) {
-			top_inspection2 = top_inspection1;
-			top_inspection1 = inspections[i];
-		} else if (inspections[i] > top_inspection2) {
-			top_inspection2 = inspections[i];
+		inspections[i] += cycle_count * cycle_inspections[i];
+	}
+	day11_item_rounds(run, state, remaining % cycle_length, inspections);
+}
+
+static void *day11_item_worker(void *p)
+{
+	day11_ItemWorker *worker = p;
+	day11_IndependentRun *run = worker->run;
+	size_t item;
+	while ((item = __atomic_fetch_add(&run->next_item, 1, __ATOMIC_RELAXED)) < run->item_count) {
+		day11_track_item(run, run->items[item], worker->inspections);
+	}
+	return NULL;
+}
+
+// Same result as solve(data, rounds, false), but the work only depends on
+// the cycle lengths of the items, so `rounds` can be huge. Items are spread
+// over all cores.
+static u128 solve_independent(day11_Data *data, uint64_t rounds)
+{
+	int monkey_count = data->count;
+
+	day11_Divisor tests[monkey_count];
+	day11_Modulus modulus = day11_modulus(data);
+	size_t item_count = 0;
+	for (int i = 0; i < monkey_count; i++) {
+		tests[i] = day11_divisor(data->monkeys[i].test_value);
+		item_count += data->monkeys[i].item_count;
+	}
+
+	day11_IndependentRun run = {
+		.data = data,
+		.tests = tests,
+		.modulus = modulus,
+		.rounds = rounds,
+		.items = malloc(item_count * sizeof(day11_ItemState)),
+		.item_count = item_count,
+		.next_item = 0
+	};
+	size_t item_idx = 0;
+	for (int i = 0; i < monkey_count; i++) {
+		Monkey *monkey = &data->monkeys[i];
+		for (int j = 0; j < monkey->item_count; j++) {
+			run.items[item_idx++] = (day11_ItemState){ i, day11_reduce(monkey->items[j], &modulus) };
+		}
+	}
+
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t thread_count = MAX(1, MIN(cpu_count, item_count));
+	day11_ItemWorker workers[thread_count];
+	for (size_t i = 0; i < thread_count; i++) {
+		workers[i].run = &run;
+		workers[i].inspections = calloc(monkey_count, sizeof(uint64_t));
+	}
+
+	// Items are claimed through `run.next_item`, so a worker that didn't get
+	// a thread finds none left by the time it runs here, after worker 0
+	bool started[thread_count];
+	for (size_t i = 1; i < thread_count; i++) {
+		started[i] = pthread_create(&workers[i].thread, NULL, day11_item_worker, &workers[i]) == 0;
+	}
+	day11_item_worker(&workers[0]);
+	for (size_t i = 1; i < thread_count; i++) {
+		if (!started[i]) {
+			day11_item_worker(&workers[i]);
 		}
 	}
 
-	return top_inspection1*top_inspection2;
+	uint64_t inspections[monkey_count];
+	memset(inspections, 0, sizeof(inspections));
+	for (size_t i = 0; i < thread_count; i++) {
+		if (i > 0 && started[i]) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		for (int j = 0; j < monkey_count; j++) {
+			inspections[j] += workers[i].inspections[j];
+		}
+		free(workers[i].inspections);
+	}
+	free(run.items);
+
+	return day11_monkey_business(inspections, monkey_count);
+}
+
+static void day11_print_u128(u128 value)
+{
+	char digits[40];
+	int count = 0;
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	while (count > 0) {
+		putchar(digits[--count]);
+	}
+	putchar('\n');
 }
 
 static void day11_part1(void *p)
 {
-	printf("%lu\n", solve(p, 20, true));
+	day11_print_u128(solve(p, 20, true));
 }
 
 
 static void day11_part2(void *p)
 {
-	printf("%lu\n", solve(p, 10000, false));
+	int rounds = 10000;
+	if (rounds < DAY11_MIN_CYCLE_ROUNDS) {
+		day11_print_u128(solve(p, rounds, false));
+	} else {
+		day11_print_u128(solve_independent(p, rounds));
+	}
 }
 
 ADD_SOLUTION(11, day11_parse, day11_part1, day11_part2);
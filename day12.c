@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "aoc.h"
 #include "types.h"
@@ -13,8 +15,23 @@ typedef struct {
 	u32 height;
 	vec2_u32 start;
 	vec2_u32 end;
+
+	// Distance from every cell to the end, filled by day12_distance_to_end
+	u32 *to_end;
 } day12_map;
 
+#define DAY12_UNREACHABLE ((u32)-1)
+// Rough cost of expanding one frontier cell on its own, in bitmap words
+#define DAY12_SPARSE_COST 4
+// Smaller frontiers are always expanded cell by cell, they don't pay for
+// building the bitmaps
+#define DAY12_DENSE_MIN_CELLS 1024
+
+typedef enum {
+	DAY12_CLIMB_UP,  // At most one higher per step, walking towards the end
+	DAY12_CLIMB_DOWN // At most one lower per step, walking back from the end
+} day12_climb;
+
 static void print_day12_map(day12_map *map)
 {
 	for (size_t y = 0; y < map->height; y++) {
@@ -56,6 +73,7 @@ static void *day12_parse(char **lines, int line_count)
 		}
 	}
 
+	map->to_end = NULL;
 	return map;
 }
 
@@ -64,126 +82,387 @@ static bool day12_is_in_bounds(day12_map *map, i32 x, i32 y)
 	return x >= 0 && y >= 0 && x < map->width && y < map->height;
 }
 
-static int day12_find_by_coord(u32 *stack_x, u32 *stack_y, size_t stack_size, u32 x, u32 y)
+static u32 day12_cell_index(day12_map *map, vec2_u32 cell)
 {
-	for (int i = 0; i < stack_size; i++) {
-		if (stack_x[i] == x && stack_y[i] == y) {
-			return i;
+	return cell.y * map->width + cell.x;
+}
+
+// Cells as bits, every row padded to whole words so shifts along a row
+// never carry into the next one
+typedef struct {
+	u64 *words;
+	u32 row_words;
+} day12_Bitmap;
+
+static void day12_bitmap_init(day12_Bitmap *bitmap, day12_map *map)
+{
+	bitmap->row_words = (map->width + 63) / 64;
+	bitmap->words = calloc((size_t)bitmap->row_words * map->height, sizeof(u64));
+}
+
+static u64 *day12_bitmap_row(day12_Bitmap *bitmap, u32 y)
+{
+	return bitmap->words + (size_t)y * bitmap->row_words;
+}
+
+static void day12_bitmap_set(day12_Bitmap *bitmap, u32 x, u32 y)
+{
+	day12_bitmap_row(bitmap, y)[x / 64] |= 1ull << (x % 64);
+}
+
+// Step directions, named by where the step comes from
+enum { DAY12_FROM_NORTH, DAY12_FROM_SOUTH, DAY12_FROM_WEST, DAY12_FROM_EAST, DAY12_DIRECTION_COUNT };
+
+static const i8 day12_from_x[] = { 0, 0, -1, 1 };
+static const i8 day12_from_y[] = { -1, 1, 0, 0 };
+
+// Bit d of enterable[idx] is set if the cell can be stepped into from its
+// neighbour in direction d. Every direction is its own pass over a row, so
+// the comparisons vectorize.
+static u8 *day12_enterable(day12_map *map, day12_climb climb)
+{
+	u32 width = map->width;
+	i32 sign = climb == DAY12_CLIMB_DOWN ? -1 : 1;
+	u8 *enterable = calloc((size_t)width * map->height, sizeof(u8));
+	for (u32 y = 0; y < map->height; y++) {
+		const u8 *restrict row = map->map + (size_t)y * width;
+		u8 *restrict out = enterable + (size_t)y * width;
+		if (y > 0) {
+			const u8 *restrict north = row - width;
+			for (u32 x = 0; x < width; x++) {
+				out[x] |= ((row[x] - north[x]) * sign <= 1) << DAY12_FROM_NORTH;
+			}
+		}
+		if (y+1 < map->height) {
+			const u8 *restrict south = row + width;
+			for (u32 x = 0; x < width; x++) {
+				out[x] |= ((row[x] - south[x]) * sign <= 1) << DAY12_FROM_SOUTH;
+			}
+		}
+		for (u32 x = 1; x < width; x++) {
+			out[x] |= ((row[x] - row[x-1]) * sign <= 1) << DAY12_FROM_WEST;
+		}
+		for (u32 x = 0; x+1 < width; x++) {
+			out[x] |= ((row[x] - row[x+1]) * sign <= 1) << DAY12_FROM_EAST;
 		}
 	}
-	return -1;
+	return enterable;
 }
 
-static void day12_remove_at(u32 *array, u32 size, size_t at)
+// Packs the enterable flags into one bitmap per direction
+static void day12_climbable_masks(day12_map *map, const u8 *enterable, day12_Bitmap enter[DAY12_DIRECTION_COUNT])
 {
-	for (int i = at; i < size-1; i++) {
-		array[i] = array[i+1];
+	for (int d = 0; d < DAY12_DIRECTION_COUNT; d++) {
+		day12_bitmap_init(&enter[d], map);
 	}
+
+	u32 row_words = enter[0].row_words;
+	for (u32 y = 0; y < map->height; y++) {
+		for (u32 w = 0; w < row_words; w++) {
+			const u8 *flags = enterable + (size_t)y * map->width + w * 64;
+			u32 count = MIN(64, map->width - w * 64);
+			u64 bits[DAY12_DIRECTION_COUNT] = { 0 };
+			for (u32 b = 0; b < count; b++) {
+				for (int d = 0; d < DAY12_DIRECTION_COUNT; d++) {
+					bits[d] |= (u64)((flags[b] >> d) & 1) << b;
+				}
+			}
+			for (int d = 0; d < DAY12_DIRECTION_COUNT; d++) {
+				enter[d].words[(size_t)y * row_words + w] = bits[d];
+			}
+		}
+	}
+}
+
+// Cells reached in one BFS step. The list is always kept, the bitmap only
+// once a word-parallel step needs it. The bounding box (in rows and words)
+// covers every cell.
+typedef struct {
+	day12_Bitmap bits;
+	bool has_bits;
+	u32 *cells;
+	size_t count;
+	u32 first_row, last_row;
+	u32 first_word, last_word;
+} day12_Frontier;
+
+static void day12_frontier_reset(day12_Frontier *frontier, day12_map *map)
+{
+	frontier->has_bits = false;
+	frontier->count = 0;
+	frontier->first_row = map->height;
+	frontier->last_row = 0;
+	frontier->first_word = frontier->bits.row_words;
+	frontier->last_word = 0;
+}
+
+static void day12_frontier_init(day12_Frontier *frontier, day12_map *map)
+{
+	day12_bitmap_init(&frontier->bits, map);
+	frontier->cells = malloc((size_t)map->width * map->height * sizeof(u32));
+	day12_frontier_reset(frontier, map);
+}
+
+static void day12_frontier_free(day12_Frontier *frontier)
+{
+	free(frontier->bits.words);
+	free(frontier->cells);
+}
+
+static void day12_frontier_add(day12_Frontier *frontier, day12_map *map, u32 x, u32 y)
+{
+	frontier->cells[frontier->count++] = y * map->width + x;
+	frontier->first_row = MIN(frontier->first_row, y);
+	frontier->last_row = MAX(frontier->last_row, y);
+	frontier->first_word = MIN(frontier->first_word, x / 64);
+	frontier->last_word = MAX(frontier->last_word, x / 64);
+}
+
+static size_t day12_frontier_box_words(day12_Frontier *frontier)
+{
+	return (size_t)(frontier->last_row - frontier->first_row + 1) * (frontier->last_word - frontier->first_word + 1);
 }
 
-static void day12_insert_at(u32 *array, u32 size, u32 capacity, size_t at, u32 value)
+static void day12_frontier_fill_bits(day12_Frontier *frontier, day12_map *map)
 {
-	assert(size+1 <= capacity);
-	for (int i = size; i > at; i--) {
-		array[i] = array[i-1];
+	for (size_t i = 0; i < frontier->count; i++) {
+		day12_bitmap_set(&frontier->bits, frontier->cells[i] % map->width, frontier->cells[i] / map->width);
 	}
-	array[at] = value;
+	frontier->has_bits = true;
 }
 
-static size_t day12_find_sorted_idx(day12_map *map, u32 *cost_map, u32 *stack_x, u32 *stack_y, size_t stack_size, u32 cost)
+// Empties the frontier, clearing either the bitmap words under its cells or
+// the whole bounding box, whichever is less
+static void day12_frontier_clear(day12_Frontier *frontier, day12_map *map)
 {
-	for (int i = 0; i < ((int)stack_size)-1; i++) {
-		u32 x = stack_x[i];
-		u32 y = stack_y[i];
-		if (cost_map[y * map->width + x] <= cost) {
-			return i;
+	if (!frontier->has_bits) {
+		// Nothing to clear
+	} else if (frontier->count < day12_frontier_box_words(frontier)) {
+		for (size_t i = 0; i < frontier->count; i++) {
+			u32 x = frontier->cells[i] % map->width;
+			u32 y = frontier->cells[i] / map->width;
+			day12_bitmap_row(&frontier->bits, y)[x / 64] = 0;
+		}
+	} else {
+		for (u32 y = frontier->first_row; y <= frontier->last_row; y++) {
+			u64 *row = day12_bitmap_row(&frontier->bits, y);
+			memset(row + frontier->first_word, 0, (frontier->last_word - frontier->first_word + 1) * sizeof(u64));
 		}
 	}
-	return stack_size;
+	day12_frontier_reset(frontier, map);
 }
 
-static u32 *day12_djikstra(day12_map *map)
+typedef struct {
+	day12_map *map;
+	day12_climb climb;
+	i32 sign; // Multiplies a height difference into how much is climbed
+	u32 *distance;
+
+	// Only built once a step is worth doing word-parallel
+	bool has_bitmaps;
+	day12_Bitmap enter[DAY12_DIRECTION_COUNT];
+	day12_Bitmap visited;
+} day12_Search;
+
+static void day12_search_build_bitmaps(day12_Search *search)
 {
-	u32 *cost_map = malloc(map->height*map->width * sizeof(u32));
-	for (size_t y = 0; y < map->height; y++) {
-		for (size_t x = 0; x < map->width; x++) {
-			cost_map[y * map->width + x] = -1;
+	day12_map *map = search->map;
+	u8 *enterable = day12_enterable(map, search->climb);
+	day12_climbable_masks(map, enterable, search->enter);
+	free(enterable);
+	day12_bitmap_init(&search->visited, map);
+	for (u32 y = 0; y < map->height; y++) {
+		for (u32 x = 0; x < map->width; x++) {
+			if (search->distance[y * map->width + x] != DAY12_UNREACHABLE) {
+				day12_bitmap_set(&search->visited, x, y);
+			}
 		}
 	}
-	cost_map[map->end.y * map->width + map->end.x] = 0;
+	search->has_bitmaps = true;
+}
+
+// One step cell by cell, for frontiers much smaller than their bounding box
+static void day12_expand_sparse(day12_Search *search, day12_Frontier *frontier, day12_Frontier *next, u32 step)
+{
+	day12_map *map = search->map;
+	for (size_t i = 0; i < frontier->count; i++) {
+		u32 x = frontier->cells[i] % map->width;
+		u32 y = frontier->cells[i] / map->width;
+		i32 height = map->map[frontier->cells[i]];
+		for (int d = 0; d < DAY12_DIRECTION_COUNT; d++) {
+			// Moving against the direction the step comes from
+			i32 new_x = x - day12_from_x[d];
+			i32 new_y = y - day12_from_y[d];
+			if (!day12_is_in_bounds(map, new_x, new_y)) continue;
+			u32 new_idx = new_y * map->width + new_x;
+			if ((map->map[new_idx] - height) * search->sign > 1) continue;
+			if (search->distance[new_idx] != DAY12_UNREACHABLE) continue;
 
-	size_t stack_capacity = map->width*map->height;
-	u32 stack_x[stack_capacity], stack_y[stack_capacity];
-	size_t stack_size = 1;
-	stack_x[0] = map->end.x;
-	stack_y[0] = map->end.y;
+			if (search->has_bitmaps) {
+				day12_bitmap_set(&search->visited, new_x, new_y);
+			}
+			search->distance[new_idx] = step;
+			day12_frontier_add(next, map, new_x, new_y);
+		}
+	}
+}
 
-	while (stack_size > 0)
-	{
-		u32 x = stack_x[stack_size-1];
-		u32 y = stack_y[stack_size-1];
-		u32 cost = cost_map[y * map->width + x];
-		stack_size--;
+// One step 64 cells at a time: shifting the frontier one cell in each
+// direction and masking with the cells enterable from that direction gives
+// every cell of the next frontier at once. Only words around the frontier's
+// bounding box are touched.
+static void day12_expand_dense(day12_Search *search, day12_Frontier *frontier, day12_Frontier *next, u32 step)
+{
+	day12_map *map = search->map;
+	if (!search->has_bitmaps) {
+		day12_search_build_bitmaps(search);
+	}
+	if (!frontier->has_bits) {
+		day12_frontier_fill_bits(frontier, map);
+	}
 
-		if (x == map->start.x && y == map->start.y) break;
+	u32 row_words = frontier->bits.row_words;
+	u32 from_row = frontier->first_row > 0 ? frontier->first_row - 1 : 0;
+	u32 to_row = MIN(frontier->last_row + 1, map->height - 1);
+	u32 from_word = frontier->first_word > 0 ? frontier->first_word - 1 : 0;
+	u32 to_word = MIN(frontier->last_word + 1, row_words - 1);
 
-		u8 height = map->map[y * map->width + x];
+	for (u32 y = from_row; y <= to_row; y++) {
+		u64 *row = day12_bitmap_row(&frontier->bits, y);
+		u64 *north = y > 0 ? day12_bitmap_row(&frontier->bits, y-1) : NULL;
+		u64 *south = y+1 < map->height ? day12_bitmap_row(&frontier->bits, y+1) : NULL;
+		u64 *seen = day12_bitmap_row(&search->visited, y);
+		u64 *out = day12_bitmap_row(&next->bits, y);
 
-		i8 ox[] = { 0, 0, 1, -1 };
-		i8 oy[] = { 1, -1, 0, 0 };
-		for (int i = 0; i < 4; i++) {
-			i32 new_x = x + ox[i];
-			i32 new_y = y + oy[i];
-			if (!day12_is_in_bounds(map, new_x, new_y)) continue;
-			u8 new_height = map->map[new_y * map->width + new_x];
-			if (height - new_height > 1) continue;
+		u64 any = 0;
+		for (u32 w = from_word; w <= to_word; w++) {
+			u64 from_north = north ? north[w] : 0;
+			u64 from_south = south ? south[w] : 0;
+			u64 from_west = (row[w] << 1) | (w > 0 ? row[w-1] >> 63 : 0);
+			u64 from_east = (row[w] >> 1) | (w+1 < row_words ? row[w+1] << 63 : 0);
 
-			if (cost_map[new_y * map->width + new_x] > cost + 1) {
-				if (cost_map[new_y * map->width + new_x] == cost + 1) continue;
+			size_t idx = (size_t)y * row_words + w;
+			u64 reached = (from_north & search->enter[DAY12_FROM_NORTH].words[idx])
+				| (from_south & search->enter[DAY12_FROM_SOUTH].words[idx])
+				| (from_west & search->enter[DAY12_FROM_WEST].words[idx])
+				| (from_east & search->enter[DAY12_FROM_EAST].words[idx]);
+			reached &= ~seen[w];
+			seen[w] |= reached;
+			out[w] = reached;
+			any |= reached;
+		}
+		if (!any) continue;
 
-				int stack_idx = day12_find_by_coord(stack_x, stack_y, stack_size, new_x, new_y);
-				if (stack_idx != -1) {
-					day12_remove_at(stack_x, stack_size, stack_idx);
-					day12_remove_at(stack_y, stack_size, stack_idx);
-					stack_size--;
-				}
-				cost_map[new_y * map->width + new_x] = cost + 1;
-				size_t sorted_idx = day12_find_sorted_idx(map, cost_map, stack_x, stack_y, stack_size, cost + 1);
-				day12_insert_at(stack_x, stack_size, stack_capacity, sorted_idx, new_x);
-				day12_insert_at(stack_y, stack_size, stack_capacity, sorted_idx, new_y);
-				stack_size++;
+		// Cells are listed separately, so the loop above stays branch-free
+		for (u32 w = from_word; w <= to_word; w++) {
+			u64 reached = out[w];
+			if (reached == 0) continue;
+			next->first_word = MIN(next->first_word, w);
+			next->last_word = MAX(next->last_word, w);
+			while (reached) {
+				u32 idx = y * map->width + w * 64 + __builtin_ctzll(reached);
+				search->distance[idx] = step;
+				next->cells[next->count++] = idx;
+				reached &= reached - 1;
 			}
 		}
+		next->first_row = MIN(next->first_row, y);
+		next->last_row = MAX(next->last_row, y);
+	}
+	next->has_bits = true;
+}
+
+// All steps cost 1, so a breadth-first search visits cells in order of
+// distance. Starting from every source at once gives each cell its distance
+// to the nearest source; unreachable cells are DAY12_UNREACHABLE.
+//
+// Each step picks the cheaper expansion: word-parallel over the frontier's
+// bounding box when the frontier fills it densely, cell by cell otherwise.
+static u32 *day12_search(day12_map *map, const u32 *sources, size_t source_count, day12_climb climb)
+{
+	size_t cell_count = (size_t)map->height * map->width;
+	day12_Search search = {
+		.map = map,
+		.climb = climb,
+		.sign = climb == DAY12_CLIMB_DOWN ? -1 : 1
+	};
+	search.distance = malloc(cell_count * sizeof(u32));
+	memset(search.distance, 0xff, cell_count * sizeof(u32));
+
+	day12_Frontier frontier, next;
+	day12_frontier_init(&frontier, map);
+	day12_frontier_init(&next, map);
+	for (size_t i = 0; i < source_count; i++) {
+		u32 x = sources[i] % map->width;
+		u32 y = sources[i] / map->width;
+		if (search.distance[sources[i]] == 0) continue;
+
+		search.distance[sources[i]] = 0;
+		day12_frontier_add(&frontier, map, x, y);
+	}
+
+	for (u32 step = 1; frontier.count > 0; step++) {
+		size_t box_words = (size_t)(frontier.last_row - frontier.first_row + 3) * (frontier.last_word - frontier.first_word + 3);
+		if (frontier.count >= DAY12_DENSE_MIN_CELLS && frontier.count * DAY12_SPARSE_COST >= box_words) {
+			day12_expand_dense(&search, &frontier, &next, step);
+		} else {
+			day12_expand_sparse(&search, &frontier, &next, step);
+		}
+
+		day12_frontier_clear(&frontier, map);
+		day12_Frontier tmp = frontier;
+		frontier = next;
+		next = tmp;
+	}
+
+	if (search.has_bitmaps) {
+		for (int d = 0; d < DAY12_DIRECTION_COUNT; d++) {
+			free(search.enter[d].words);
+		}
+		free(search.visited.words);
+	}
+	day12_frontier_free(&frontier);
+	day12_frontier_free(&next);
+	return search.distance;
+}
+
+// One search back from the end answers the distance from any start
+static u32 *day12_distance_to_end(day12_map *map)
+{
+	if (map->to_end == NULL) {
+		u32 end = day12_cell_index(map, map->end);
+		map->to_end = day12_search(map, &end, 1, DAY12_CLIMB_DOWN);
 	}
+	return map->to_end;
+}
 
-	return cost_map;
+// Shortest distance to the end from any cell of the given height
+static u32 day12_closest_to_end(day12_map *map, u8 height)
+{
+	u32 *to_end = day12_distance_to_end(map);
+	size_t cell_count = (size_t)map->height * map->width;
+	u32 lowest_cost = DAY12_UNREACHABLE;
+	for (size_t idx = 0; idx < cell_count; idx++) {
+		if (map->map[idx] == height && to_end[idx] < lowest_cost) {
+			lowest_cost = to_end[idx];
+		}
+	}
+	return lowest_cost;
 }
 
 static void day12_part1(void *p)
 {
 	day12_map *map = (day12_map*)p;
 
-	u32 *cost_map = day12_djikstra(map);
-	printf("Cost: %d\n", cost_map[map->start.y * map->width + map->start.x]);
+	u32 *to_end = day12_distance_to_end(map);
+	printf("Cost: %d\n", to_end[day12_cell_index(map, map->start)]);
 }
 
 static void day12_part2(void *p)
 {
 	day12_map *map = (day12_map*)p;
 
-	u32 *cost_map = day12_djikstra(map);
-	u32 lowest_cost = -1;
-	for (u32 y = 0; y < map->height; y++) {
-		for (u32 x = 0; x < map->height; x++) {
-			u32 idx = y * map->width + x;
-			u32 cost = cost_map[idx];
-			if (lowest_cost > cost && map->map[idx] == 0) {
-				lowest_cost = cost;
-			}
-		}
-	}
-
-	printf("Cost: %d\n", lowest_cost);
+	printf("Cost: %d\n", day12_closest_to_end(map, 0));
 }
 
 ADD_SOLUTION(12, day12_parse, day12_part1, day12_part2);
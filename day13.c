@@ -3,228 +3,386 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/param.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "types.h"
 #include "aoc.h"
 
-typedef struct day13_packet *day13_packet_ptr;
+// Packets are stored flat, as a stream of tokens: every number is its own
+// token, lists are delimited by DAY13_OPEN and DAY13_CLOSE.
+#define DAY13_OPEN  ((u32)-2)
+#define DAY13_CLOSE ((u32)-1)
 
-struct day13_packet {
-	bool is_number;
-	union {
-		u8 number;
-		struct {
-			day13_packet_ptr list;
-			size_t list_size;
-		};
-	};
-};
+#define DAY13_MIN_PACKETS_PER_THREAD 4096
 
+// All packets share one token arena, `starts[i]` is where packet i begins.
+// Packets 2*i and 2*i+1 form pair i.
 typedef struct {
-	struct day13_packet left;
-	struct day13_packet right;
-} day13_packet_pair;
+	u32 *tokens;
+	size_t token_count;
+	size_t token_capacity;
 
-typedef struct {
-	day13_packet_pair* pairs;
+	size_t *starts;
 	size_t count;
-} day13_packet_pairs;
+	size_t capacity;
+} day13_Packets;
 
 static bool day13_is_digit(char c)
 {
 	return '0' <= c && c <= '9';
 }
 
-static size_t day13_parse_packet(struct day13_packet *result, char *packet)
+static void day13_push_token(day13_Packets *packets, u32 token)
 {
-	size_t bytes_read = 0;
+	if (packets->token_count == packets->token_capacity) {
+		packets->token_capacity = MAX(64, packets->token_capacity * 2);
+		packets->tokens = realloc(packets->tokens, packets->token_capacity * sizeof(u32));
+	}
+	packets->tokens[packets->token_count++] = token;
+}
 
-	if (packet[0] == '[') {
-		bytes_read++;
-		result->is_number = false;
-		result->list_size = 0;
-		result->list = NULL;
-		if (packet[1] != ']') {
-			while (true) {
-				result->list = realloc(result->list, sizeof(struct day13_packet)*(result->list_size+1));
-				bytes_read += day13_parse_packet(&result->list[result->list_size], packet+bytes_read);
-				result->list_size++;
+static void day13_parse_packet(day13_Packets *packets, char *packet)
+{
+	if (packets->count == packets->capacity) {
+		packets->capacity = MAX(16, packets->capacity * 2);
+		packets->starts = realloc(packets->starts, packets->capacity * sizeof(size_t));
+	}
+	packets->starts[packets->count++] = packets->token_count;
 
-				if (packet[bytes_read] == ',') {
-					bytes_read++;
-					continue;
-				}
-				if (packet[bytes_read] == ']') break;
-				assert(false && "fuck");
+	for (char *c = packet; *c != '\0'; c++) {
+		if (*c == '[') {
+			day13_push_token(packets, DAY13_OPEN);
+		} else if (*c == ']') {
+			day13_push_token(packets, DAY13_CLOSE);
+		} else if (day13_is_digit(*c)) {
+			u32 number = 0;
+			while (day13_is_digit(c[1])) {
+				number = number * 10 + (*c - '0');
+				c++;
 			}
+			day13_push_token(packets, number * 10 + (*c - '0'));
+		} else {
+			assert(*c == ',' && "Failed to parse packet");
 		}
-		bytes_read++;
-	} else if (day13_is_digit(packet[0])) {
-		bytes_read++;
-		result->is_number = true;
-		result->number = (packet[0] - '0');
-		for (int i = 1; i < strlen(packet); i++) {
-			if (!day13_is_digit(packet[i])) break;
-			result->number *= 10;
-			result->number += (packet[i] - '0');
-			bytes_read++;
-		}
-	} else {
-		assert(false && "Failed to parse packet");
 	}
+}
 
-	return bytes_read;
+static const u32 *day13_packet(day13_Packets *packets, size_t i)
+{
+	return packets->tokens + packets->starts[i];
 }
 
-static void printf_day13_packet(struct day13_packet *packet)
+static void day13_free_packets(day13_Packets *packets)
 {
-	if (packet->is_number) {
-		printf("%d", packet->number);
-	} else {
-		printf("[");
-		if (packet->list_size > 0) {
-			for (int i = 0; i < packet->list_size-1; i++) {
-				printf_day13_packet(&packet->list[i]);
-				printf(",");
-			}
-			printf_day13_packet(&packet->list[packet->list_size-1]);
+	free(packets->tokens);
+	free(packets->starts);
+}
+
+static void printf_day13_packet(const u32 *packet)
+{
+	int depth = 0;
+	bool needs_comma = false;
+	do {
+		if (*packet == DAY13_CLOSE) {
+			printf("]");
+			depth--;
+			needs_comma = true;
+			continue;
 		}
-		printf("]");
-	}
+
+		if (needs_comma) printf(",");
+		if (*packet == DAY13_OPEN) {
+			printf("[");
+			depth++;
+			needs_comma = false;
+		} else {
+			printf("%u", *packet);
+			needs_comma = true;
+		}
+	} while (packet++, depth > 0);
 }
 
 static void *day13_parse(char **lines, int line_count)
 {
 	size_t n = (line_count+1)/3;
-	day13_packet_pair *pairs = malloc(sizeof(day13_packet_pair)*n);
+	day13_Packets *packets = calloc(1, sizeof(day13_Packets));
 
 	for (int i = 0; i < n; i++)
 	{
-		day13_parse_packet(&pairs[i].left , lines[3*i+0]);
-		day13_parse_packet(&pairs[i].right, lines[3*i+1]);
+		day13_parse_packet(packets, lines[3*i+0]);
+		day13_parse_packet(packets, lines[3*i+1]);
 	}
 
-	day13_packet_pairs *result = malloc(sizeof(day13_packet_pairs));
-	result->pairs = pairs;
-	result->count = n;
-	return result;
+	return packets;
 }
 
+// Walks both token streams once, without recursion or allocation.
+// A number compared against a list is promoted to a one-element list: the
+// list's DAY13_OPEN is matched by a virtual one, and once the number has been
+// consumed, `*_closes` virtual DAY13_CLOSE tokens are read in its place.
+// A number can be wrapped several times, `*_wraps` counts how often.
+//
 // Return values:
 //  -1 = left is lower
 //   0 = equal
 //   1 = right is lower
-static int day13_compare(struct day13_packet *left, struct day13_packet *right)
+static int day13_compare(const u32 *left, const u32 *right)
 {
-	if (left->is_number && right->is_number) {
-		if (left->number == right->number) {
-			return 0;
-		} else if (left->number < right->number) {
-			return -1;
-		} else {
-			return 1;
-		}
-	} else if (!left->is_number && !right->is_number) {
-		for (int i = 0; i < MIN(left->list_size, right->list_size); i++) {
-			int item_result = day13_compare(&left->list[i], &right->list[i]);
-			if (item_result != 0) {
-				return item_result;
+	u32 left_wraps = 0, right_wraps = 0;
+	u32 left_closes = 0, right_closes = 0;
+	u32 depth = 0;
+
+	while (true) {
+		u32 a = left_closes > 0 ? DAY13_CLOSE : *left;
+		u32 b = right_closes > 0 ? DAY13_CLOSE : *right;
+
+		if (a == b) {
+			if (left_closes > 0) {
+				left_closes--;
+			} else {
+				left++;
+				if (a < DAY13_OPEN) {
+					left_closes = left_wraps;
+					left_wraps = 0;
+				}
 			}
-		}
-		if (left->list_size < right->list_size) {
+			if (right_closes > 0) {
+				right_closes--;
+			} else {
+				right++;
+				if (b < DAY13_OPEN) {
+					right_closes = right_wraps;
+					right_wraps = 0;
+				}
+			}
+
+			if (a == DAY13_OPEN) {
+				depth++;
+			} else if (a == DAY13_CLOSE) {
+				depth--;
+			}
+			if (depth == 0) return 0;
+		} else if (a == DAY13_CLOSE) {
 			return -1;
-		} else if (left->list_size > right->list_size) {
+		} else if (b == DAY13_CLOSE) {
 			return 1;
+		} else if (a == DAY13_OPEN) {
+			left++;
+			right_wraps++;
+			depth++;
+		} else if (b == DAY13_OPEN) {
+			right++;
+			left_wraps++;
+			depth++;
+		} else {
+			return a < b ? -1 : 1;
 		}
-	} else if (left->is_number && !right->is_number) {
-		struct day13_packet packet = {
-			.is_number = false,
-			.list = left,
-			.list_size = 1
-		};
-		return day13_compare(&packet, right);
-	} else if (!left->is_number && right->is_number) {
-		struct day13_packet packet = {
-			.is_number = false,
-			.list = right,
-			.list_size = 1
-		};
-		return day13_compare(left, &packet);
-	}
-	return 0;
+	}
 }
 
 static void day13_part1(void *p)
 {
-	day13_packet_pairs *pairs = (day13_packet_pairs*)p;
+	day13_Packets *packets = (day13_Packets*)p;
 	int result = 0;
-	for (int i = 0; i < pairs->count; i++) {
-		if (day13_compare(&pairs->pairs[i].left, &pairs->pairs[i].right) == -1) {
+	for (int i = 0; i < packets->count/2; i++) {
+		if (day13_compare(day13_packet(packets, 2*i), day13_packet(packets, 2*i+1)) == -1) {
 			result += (i+1);
 		}
 	}
 	printf("Answer: %d\n", result);
 }
 
-static int day13_find_packet(struct day13_packet **packets, size_t count, struct day13_packet *target)
+typedef struct {
+	const u32 **packets;
+	const u32 **tmp;
+	size_t from, mid, to;
+} day13_SortJob;
+
+// Merges the sorted runs [from, mid) and [mid, to) of `src` into `dst`.
+// Ties take the left run first, so the sort is stable.
+static void day13_merge(const u32 **src, const u32 **dst, size_t from, size_t mid, size_t to)
 {
-	for (int i = 0; i < count; i++) {
-		if (packets[i] == target) {
-			return i;
+	size_t i = from, j = mid, k = from;
+	while (i < mid && j < to) {
+		if (day13_compare(src[j], src[i]) < 0) {
+			dst[k++] = src[j++];
+		} else {
+			dst[k++] = src[i++];
 		}
 	}
-	return -1;
+	memcpy(&dst[k], &src[i], (mid - i) * sizeof(u32*));
+	k += mid - i;
+	memcpy(&dst[k], &src[j], (to - j) * sizeof(u32*));
 }
 
-static void day13_swap(struct day13_packet **A, struct day13_packet **B)
+// Bottom-up merge sort of [from, to), `tmp` must be as large as `packets`
+static void day13_merge_sort(const u32 **packets, const u32 **tmp, size_t from, size_t to)
 {
-	struct day13_packet *C = *A;
-	*A = *B;
-	*B = C;
+	const u32 **src = packets, **dst = tmp;
+	for (size_t width = 1; width < to - from; width *= 2) {
+		for (size_t start = from; start < to; start += 2*width) {
+			size_t mid = MIN(start + width, to);
+			size_t end = MIN(start + 2*width, to);
+			day13_merge(src, dst, start, mid, end);
+		}
+		const u32 **swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != packets) {
+		memcpy(&packets[from], &src[from], (to - from) * sizeof(u32*));
+	}
 }
 
-// bubble sort
-static void day13_sort_packets(struct day13_packet **packets, size_t count)
+static void *day13_sort_worker(void *p)
 {
-	for (int i = 0; i < count-1; i++) {
-		for (int j = i+1; j < count; j++) {
-			int cmp = day13_compare(packets[i], packets[j]);
-			if (cmp == 1) {
-				day13_swap(&packets[i], &packets[j]);
-			}
+	day13_SortJob *job = p;
+	if (job->mid == job->to) {
+		day13_merge_sort(job->packets, job->tmp, job->from, job->to);
+	} else {
+		day13_merge(job->packets, job->tmp, job->from, job->mid, job->to);
+		memcpy(&job->packets[job->from], &job->tmp[job->from], (job->to - job->from) * sizeof(u32*));
+	}
+	return NULL;
+}
+
+// Job 0 runs on the calling thread. Chunks are disjoint, so one that
+// didn't get a thread is sorted or merged here too, after job 0.
+static void day13_run_sort_jobs(day13_SortJob *jobs, size_t count)
+{
+	pthread_t threads[count];
+	bool started[count];
+	for (size_t i = 1; i < count; i++) {
+		started[i] = pthread_create(&threads[i], NULL, day13_sort_worker, &jobs[i]) == 0;
+	}
+	day13_sort_worker(&jobs[0]);
+	for (size_t i = 1; i < count; i++) {
+		if (!started[i]) {
+			day13_sort_worker(&jobs[i]);
+		}
+	}
+	for (size_t i = 1; i < count; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
 		}
 	}
 }
 
-static void day13_part2(void *p)
+// Every thread merge sorts one chunk, then neighbouring chunks are merged
+// pairwise, with the merges of each level running in parallel
+static void day13_sort_packets(const u32 **packets, size_t count)
 {
-	day13_packet_pairs *pairs = (day13_packet_pairs*)p;
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t chunk_count = MAX(1, MIN(cpu_count, count / DAY13_MIN_PACKETS_PER_THREAD));
+	const u32 **tmp = malloc(count * sizeof(u32*));
 
-	size_t packet_count = pairs->count*2 + 2;
-	struct day13_packet **packets = malloc(sizeof(struct day13_packet*)*packet_count);
+	size_t bounds[chunk_count + 1];
+	day13_SortJob jobs[chunk_count];
+	for (size_t i = 0; i <= chunk_count; i++) {
+		bounds[i] = count * i / chunk_count;
+	}
+	for (size_t i = 0; i < chunk_count; i++) {
+		jobs[i] = (day13_SortJob){ packets, tmp, bounds[i], bounds[i+1], bounds[i+1] };
+	}
+	day13_run_sort_jobs(jobs, chunk_count);
+
+	for (size_t width = 1; width < chunk_count; width *= 2) {
+		size_t job_count = 0;
+		for (size_t i = 0; i + width < chunk_count; i += 2*width) {
+			size_t end = MIN(i + 2*width, chunk_count);
+			jobs[job_count++] = (day13_SortJob){ packets, tmp, bounds[i], bounds[i + width], bounds[end] };
+		}
+		day13_run_sort_jobs(jobs, job_count);
+	}
 
-	// insert divider [[2]]
-	struct day13_packet divider1;
-	day13_parse_packet(&divider1, "[[2]]");
-	packets[0] = &divider1;
+	free(tmp);
+}
 
-	// insert divider [[6]]
-	struct day13_packet divider2;
-	day13_parse_packet(&divider2, "[[6]]");
-	packets[1] = &divider2;
+// Where both dividers would end up if all packets were sorted, without
+// sorting: one plus the number of packets lower than each. A packet below
+// the first divider is below the second one too, which saves a compare.
+// Packets equal to a divider end up after it, as with a stable sort of the
+// dividers followed by the packets.
+static void day13_divider_ranks(day13_Packets *packets, const u32 *divider1, const u32 *divider2, size_t *rank1, size_t *rank2)
+{
+	assert(day13_compare(divider1, divider2) < 0);
 
-	// insert packets from `pairs.pairs`
-	for (int i = 0; i < pairs->count; i++) {
-		packets[2 + i*2+0] = &pairs->pairs[i].left;
-		packets[2 + i*2+1] = &pairs->pairs[i].right;
+	size_t below1 = 0, below2 = 0;
+	for (size_t i = 0; i < packets->count; i++) {
+		const u32 *packet = day13_packet(packets, i);
+		if (day13_compare(packet, divider1) < 0) {
+			below1++;
+			below2++;
+		} else if (day13_compare(packet, divider2) < 0) {
+			below2++;
+		}
 	}
 
-	day13_sort_packets(packets, packet_count);
+	*rank1 = below1 + 1;
+	*rank2 = below2 + 2; // The first divider is below the second one
+}
+
+// All packets in ascending order, equal ones keep their input order.
+// The returned array is owned by the caller.
+static const u32 **day13_sorted_packets(day13_Packets *packets)
+{
+	const u32 **sorted = malloc(packets->count * sizeof(u32*));
+	for (size_t i = 0; i < packets->count; i++) {
+		sorted[i] = day13_packet(packets, i);
+	}
+	day13_sort_packets(sorted, packets->count);
+	return sorted;
+}
+
+#ifdef DAY13_CHECK_SORT
+// Index of the first packet in `sorted` that isn't lower than `packet`
+static size_t day13_lower_bound(const u32 **sorted, size_t count, const u32 *packet)
+{
+	size_t from = 0, to = count;
+	while (from < to) {
+		size_t mid = from + (to - from) / 2;
+		if (day13_compare(sorted[mid], packet) < 0) {
+			from = mid + 1;
+		} else {
+			to = mid;
+		}
+	}
+	return from;
+}
+
+// Checks the divider ranks against a full sort, which costs far more than
+// finding them. Only built with `make CFLAGS=-DDAY13_CHECK_SORT`.
+static void day13_check_divider_ranks(day13_Packets *packets, const u32 *divider1, const u32 *divider2, size_t rank1, size_t rank2)
+{
+	const u32 **sorted = day13_sorted_packets(packets);
+	for (size_t i = 1; i < packets->count; i++) {
+		assert(day13_compare(sorted[i-1], sorted[i]) <= 0);
+	}
+	assert(day13_lower_bound(sorted, packets->count, divider1) + 1 == rank1);
+	assert(day13_lower_bound(sorted, packets->count, divider2) + 2 == rank2);
+	free(sorted);
+}
+#endif
+
+static void day13_part2(void *p)
+{
+	day13_Packets *pairs = (day13_Packets*)p;
+
+	day13_Packets dividers = { 0 };
+	day13_parse_packet(&dividers, "[[2]]");
+	day13_parse_packet(&dividers, "[[6]]");
+
+	size_t divider1_idx, divider2_idx;
+	day13_divider_ranks(pairs, day13_packet(&dividers, 0), day13_packet(&dividers, 1), &divider1_idx, &divider2_idx);
+	size_t answer = divider1_idx * divider2_idx;
+	printf("Answer: %zu\n", answer);
+
+#ifdef DAY13_CHECK_SORT
+	day13_check_divider_ranks(pairs, day13_packet(&dividers, 0), day13_packet(&dividers, 1), divider1_idx, divider2_idx);
+#endif
 
-	int divider1_idx = day13_find_packet(packets, packet_count, &divider1);
-	int divider2_idx = day13_find_packet(packets, packet_count, &divider2);
-	int answer = (divider1_idx+1) * (divider2_idx+1);
-	printf("Answer: %d\n", answer);
+	day13_free_packets(&dividers);
 }
 
 ADD_SOLUTION(13, day13_parse, day13_part1, day13_part2);
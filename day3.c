@@ -2,10 +2,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/param.h>
 
 #include "aoc.h"
+#include "types.h"
 #include "vec.h"
 
+// Below this many groups per thread, spawning threads costs more than it saves
+#define DAY3_MIN_GROUPS_PER_THREAD 4096
+
+typedef struct {
+	Vec *lines;
+	size_t from, to; // Line range, always aligned to groups of 3
+	int result;
+} day3_group_job;
+
 static void *day3_parse(char **lines, int line_count)
 {
 	Vec *vec = vec_malloc(line_count);
@@ -62,31 +75,71 @@ static void day3_part1(void *p)
 	printf("%d\n", result);
 }
 
+static u64 day3_item_mask(char *items)
+{
+	u64 mask = 0;
+	for (; *items; items++) {
+		mask |= 1ull << get_priority(*items);
+	}
+	return mask;
+}
+
+static void *day3_group_worker(void *p)
+{
+	day3_group_job *job = p;
+	Vec *lines = job->lines;
+	int result = 0;
+	for (size_t i = job->from; i < job->to; i+=3) {
+		u64 common = day3_item_mask(lines->data[i+0]) &
+		             day3_item_mask(lines->data[i+1]) &
+		             day3_item_mask(lines->data[i+2]);
+		// Bit 0 is set by non-letters, it is never a valid priority
+		common &= ~1ull;
+		if (common) {
+			result += __builtin_ctzll(common);
+		} else {
+			fprintf(stderr, "Unknown common char at line: %zu-%zu\n", i+1, i+3);
+		}
+	}
+	job->result = result;
+	return NULL;
+}
+
 static void day3_part2(void *p)
 {
 	Vec *vec = p;
-	int result = 0;
-	for (size_t i = 0; i < vec->count; i+=3) {
-		char *b1 = vec->data[i+0];
-		char *b2 = vec->data[i+1];
-		char *b3 = vec->data[i+2];
-		int size1 = strlen(b1);
-		int size2 = strlen(b2);
-		int size3 = strlen(b3);
-
-		bool found = false;
-		for (size_t j = 0; j < size1; j++) {
-			char c = b1[j];
-			if (contains(c, b2, size2) && contains(c, b3, size3)) {
-				result += get_priority(c);
-				found = true;
-				break;
-			}
+	size_t group_count = vec->count / 3;
+
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t thread_count = MAX(1, MIN(cpu_count, group_count / DAY3_MIN_GROUPS_PER_THREAD));
+
+	day3_group_job jobs[thread_count];
+	pthread_t threads[thread_count];
+	for (size_t i = 0; i < thread_count; i++) {
+		jobs[i].lines = vec;
+		jobs[i].from = 3 * (group_count * i / thread_count);
+		jobs[i].to   = 3 * (group_count * (i+1) / thread_count);
+	}
+
+	// The group ranges are fixed up front, so one that didn't get a thread
+	// is counted here, once every other range is being worked on
+	bool started[thread_count];
+	for (size_t i = 1; i < thread_count; i++) {
+		started[i] = pthread_create(&threads[i], NULL, day3_group_worker, &jobs[i]) == 0;
+	}
+	day3_group_worker(&jobs[0]);
+	for (size_t i = 1; i < thread_count; i++) {
+		if (!started[i]) {
+			day3_group_worker(&jobs[i]);
 		}
+	}
 
-		if (!found) {
-			fprintf(stderr, "Unknown common char at line: %zu-%zu\n", i+1, i+3);
+	int result = jobs[0].result;
+	for (size_t i = 1; i < thread_count; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
 		}
+		result += jobs[i].result;
 	}
 	printf("%d\n", result);
 }
@@ -1,78 +1,265 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
 
 #include "aoc.h"
+#include "types.h"
 #include "vec.h"
 
 typedef struct {
-	int from, to;
+	i32 from, to;
 } Range;
 
+// Assignments are stored as columns, so both parts are a straight
+// compare-and-count over contiguous arrays which gcc vectorizes at -O3.
+// An optional section of `a-b` query ranges can follow after an empty line.
 typedef struct {
-	Range first;
-	Range second;
-} DoubleRange;
+	i32 *from1, *to1;
+	i32 *from2, *to2;
+	size_t count;
 
-static inline void day4_parse_range(Range *range, char *s)
+	Range *queries;
+	size_t query_count;
+} day4_Data;
+
+// Index over every elf's range (two per assignment line) for answering
+// overlap/containment queries against arbitrary ranges in O(log n)
+typedef struct {
+	Range *by_from;   // Sorted by `from`
+	i32 *sorted_to;   // All `to` values, sorted
+	i32 *max_to;      // Segment tree of max `to` over `by_from`, leaves at [leaf_count, 2*leaf_count)
+	size_t leaf_count;
+	size_t count;
+} day4_RangeIndex;
+
+static inline i32 day4_parse_number(char **s)
 {
-	range->from = atoi(strsep(&s, "-"));
-	range->to   = atoi(strsep(&s, "-"));
+	i32 number = 0;
+	while ('0' <= **s && **s <= '9') {
+		number = number * 10 + (**s - '0');
+		(*s)++;
+	}
+	(*s)++; // Skip separator
+	return number;
 }
 
-static void day4_parse_line(DoubleRange *double_range, char *line)
+static void *day4_parse(char **lines, int line_count)
 {
-	char *line_copy = strdup(line);
-	char *line_copy_start = line_copy;
-	day4_parse_range(&double_range->first, strsep(&line_copy, ","));
-	day4_parse_range(&double_range->second, strsep(&line_copy, ","));
-	free(line_copy_start);
+	size_t count = 0;
+	while (count < line_count && lines[count][0] != '\0') {
+		count++;
+	}
+
+	day4_Data *data = malloc(sizeof(day4_Data));
+	data->count = count;
+	data->from1 = malloc(4 * count * sizeof(i32));
+	data->to1   = data->from1 + 1 * count;
+	data->from2 = data->from1 + 2 * count;
+	data->to2   = data->from1 + 3 * count;
+
+	for (size_t i = 0; i < count; i++) {
+		char *line = lines[i];
+		data->from1[i] = day4_parse_number(&line);
+		data->to1[i]   = day4_parse_number(&line);
+		data->from2[i] = day4_parse_number(&line);
+		data->to2[i]   = day4_parse_number(&line);
+	}
+
+	data->queries = malloc(MAX(line_count - count, 1) * sizeof(Range));
+	data->query_count = 0;
+	for (size_t i = count; i < line_count; i++) {
+		char *line = lines[i];
+		if (line[0] == '\0') continue;
+
+		Range *query = &data->queries[data->query_count++];
+		query->from = day4_parse_number(&line);
+		query->to   = day4_parse_number(&line);
+	}
+	return data;
 }
 
-static void *day4_parse(char **lines, int line_count)
+static int day4_compare_range_from(const void *a, const void *b)
+{
+	const Range *A = a, *B = b;
+	return (A->from > B->from) - (A->from < B->from);
+}
+
+static int day4_compare_i32(const void *a, const void *b)
+{
+	i32 A = *(const i32*)a, B = *(const i32*)b;
+	return (A > B) - (A < B);
+}
+
+static day4_RangeIndex *day4_build_index(day4_Data *data)
 {
-	Vec *vec = vec_malloc(line_count);
-	for (size_t i = 0; i < line_count; i++) {
-		DoubleRange *double_range = malloc(sizeof(DoubleRange));
-		vec_push(vec, double_range);
-		day4_parse_line(double_range, lines[i]);
+	day4_RangeIndex *index = malloc(sizeof(day4_RangeIndex));
+	index->count = data->count * 2;
+	index->by_from = malloc(index->count * sizeof(Range));
+	index->sorted_to = malloc(index->count * sizeof(i32));
+	for (size_t i = 0; i < data->count; i++) {
+		index->by_from[2*i+0] = (Range){ data->from1[i], data->to1[i] };
+		index->by_from[2*i+1] = (Range){ data->from2[i], data->to2[i] };
 	}
-	return vec;
+	qsort(index->by_from, index->count, sizeof(Range), day4_compare_range_from);
+
+	index->leaf_count = 1;
+	while (index->leaf_count < index->count) {
+		index->leaf_count *= 2;
+	}
+	index->max_to = malloc(2 * index->leaf_count * sizeof(i32));
+	for (size_t i = 0; i < index->leaf_count; i++) {
+		i32 to = i < index->count ? index->by_from[i].to : INT_MIN;
+		index->max_to[index->leaf_count + i] = to;
+		if (i < index->count) {
+			index->sorted_to[i] = to;
+		}
+	}
+	for (size_t i = index->leaf_count-1; i > 0; i--) {
+		index->max_to[i] = MAX(index->max_to[2*i], index->max_to[2*i+1]);
+	}
+	qsort(index->sorted_to, index->count, sizeof(i32), day4_compare_i32);
+
+	return index;
+}
+
+static void day4_free_index(day4_RangeIndex *index)
+{
+	free(index->by_from);
+	free(index->sorted_to);
+	free(index->max_to);
+	free(index);
+}
+
+// Number of ranges whose `from` is <= value
+static size_t day4_count_from_le(day4_RangeIndex *index, i32 value)
+{
+	size_t lo = 0, hi = index->count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (index->by_from[mid].from <= value) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Number of ranges whose `to` is < value
+static size_t day4_count_to_lt(day4_RangeIndex *index, i32 value)
+{
+	size_t lo = 0, hi = index->count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (index->sorted_to[mid] < value) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Every range that doesn't end before `query` starts or start after it ends, overlaps it
+static size_t day4_count_overlaps(day4_RangeIndex *index, Range query)
+{
+	size_t ends_before = day4_count_to_lt(index, query.from);
+	size_t starts_after = index->count - day4_count_from_le(index, query.to);
+	return index->count - ends_before - starts_after;
+}
+
+static void day4_count_overlaps_batch(day4_RangeIndex *index, Range *queries, size_t count, size_t *results)
+{
+	for (size_t i = 0; i < count; i++) {
+		results[i] = day4_count_overlaps(index, queries[i]);
+	}
+}
+
+static void day4_collect_containing(day4_RangeIndex *index, size_t node, size_t lo, size_t hi, size_t prefix_end, i32 min_to, Vec *result)
+{
+	if (lo >= prefix_end || index->max_to[node] < min_to) return;
+
+	if (hi - lo == 1) {
+		vec_push(result, &index->by_from[lo]);
+		return;
+	}
+
+	size_t mid = (lo + hi) / 2;
+	day4_collect_containing(index, 2*node+0, lo, mid, prefix_end, min_to, result);
+	day4_collect_containing(index, 2*node+1, mid, hi, prefix_end, min_to, result);
+}
+
+// Pushes every range which fully contains `query` into `result` as `Range*`.
+// Candidates are the prefix of `by_from` with from <= query.from, and subtrees
+// whose max `to` is too small are skipped, so it runs in O((k+1) log n)
+static void day4_find_containing(day4_RangeIndex *index, Range query, Vec *result)
+{
+	size_t prefix_end = day4_count_from_le(index, query.from);
+	day4_collect_containing(index, 1, 0, index->leaf_count, prefix_end, query.to, result);
+}
+
+static void day4_find_containing_batch(day4_RangeIndex *index, Range *queries, size_t count, Vec **results)
+{
+	for (size_t i = 0; i < count; i++) {
+		day4_find_containing(index, queries[i], results[i]);
+	}
+}
+
+// For every query range: how many elves' ranges overlap it, and how many fully contain it
+static void day4_answer_queries(day4_Data *data)
+{
+	day4_RangeIndex *index = day4_build_index(data);
+
+	size_t *overlaps = malloc(data->query_count * sizeof(size_t));
+	Vec **containing = malloc(data->query_count * sizeof(Vec*));
+	for (size_t i = 0; i < data->query_count; i++) {
+		containing[i] = vec_malloc(16);
+	}
+	day4_count_overlaps_batch(index, data->queries, data->query_count, overlaps);
+	day4_find_containing_batch(index, data->queries, data->query_count, containing);
+
+	for (size_t i = 0; i < data->query_count; i++) {
+		Range *query = &data->queries[i];
+		printf("%d-%d: %zu overlapping, %d containing\n", query->from, query->to, overlaps[i], containing[i]->count);
+		vec_free(containing[i]);
+	}
+
+	free(containing);
+	free(overlaps);
+	day4_free_index(index);
 }
 
 static void day4_part1(void *p)
 {
-	Vec *vec = p;
+	day4_Data *data = p;
+	const i32 *restrict from1 = data->from1, *restrict to1 = data->to1;
+	const i32 *restrict from2 = data->from2, *restrict to2 = data->to2;
+
 	int result = 0;
-	for (int i = 0; i < vec->count; i++) {
-		DoubleRange *double_range = vec->data[i];
-		Range *range1 = &double_range->first;
-		Range *range2 = &double_range->second;
-		if ((range1->from <= range2->from && range1->to >= range2->to) ||
-				(range2->from <= range1->from && range2->to >= range1->to)) {
-			result++;
-		}
+	for (size_t i = 0; i < data->count; i++) {
+		result += ((from1[i] <= from2[i]) & (to1[i] >= to2[i])) |
+		          ((from2[i] <= from1[i]) & (to2[i] >= to1[i]));
 	}
 	printf("%d\n", result);
 }
 
 static void day4_part2(void *p)
 {
-	Vec *vec = p;
+	day4_Data *data = p;
+	const i32 *restrict from1 = data->from1, *restrict to1 = data->to1;
+	const i32 *restrict from2 = data->from2, *restrict to2 = data->to2;
+
 	int result = 0;
-	for (int i = 0; i < vec->count; i++) {
-		DoubleRange *double_range = vec->data[i];
-		Range *range1 = &double_range->first;
-		Range *range2 = &double_range->second;
-		if ((range1->from <= range2->from && range1->to >= range2->to) ||
-				(range2->from <= range1->from && range2->to >= range1->to) ||
-				MIN(range1->to, range2->to) >= MAX(range1->from, range2->from)) {
-			result++;
-		}
+	for (size_t i = 0; i < data->count; i++) {
+		result += (from1[i] <= to2[i]) & (from2[i] <= to1[i]);
 	}
 	printf("%d\n", result);
-}
 
+	if (data->query_count > 0) {
+		day4_answer_queries(data);
+	}
+}
 
 ADD_SOLUTION(4, day4_parse, day4_part1, day4_part2);
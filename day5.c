@@ -4,6 +4,7 @@
 #include <sys/param.h>
 
 #include "aoc.h"
+#include "types.h"
 #include "vec.h"
 
 typedef struct {
@@ -11,10 +12,32 @@ typedef struct {
 } Move;
 
 typedef struct {
-	Vec *towers;
+	char *crates; // Bottom to top
+	size_t count;
+	size_t capacity;
+} day5_Tower;
+
+typedef struct {
+	day5_Tower *towers;
+	int tower_count;
 	Vec *moves;
+	u64 total_moved; // Sum of all move amounts
 } day5_Data;
 
+static void day5_tower_reserve(day5_Tower *tower, size_t capacity)
+{
+	if (capacity <= tower->capacity) return;
+
+	tower->capacity = MAX(capacity, tower->capacity * 2);
+	tower->crates = realloc(tower->crates, tower->capacity);
+}
+
+static void day5_tower_push(day5_Tower *tower, char crate)
+{
+	day5_tower_reserve(tower, tower->count + 1);
+	tower->crates[tower->count++] = crate;
+}
+
 static Move* day5_parse_move(char *line)
 {
 	char* line_copy = strdup(line);
@@ -50,16 +73,15 @@ static void *day5_parse(char **lines, int line_count)
 
 	int move_count = line_count - max_tower_height - 2;
 	Vec *moves = vec_malloc(move_count);
+	u64 total_moved = 0;
 	for (int i = 0; i < move_count; i++) {
 		char *line = lines[max_tower_height+2+i];
-		vec_push(moves, day5_parse_move(line));
+		Move *move = day5_parse_move(line);
+		total_moved += move->amount;
+		vec_push(moves, move);
 	}
 
-	Vec *towers = vec_malloc(tower_count);
-	for (int i = 0; i < tower_count; i++) {
-		char* tower = calloc(26, sizeof(char));
-		vec_push(towers, tower);
-	}
+	day5_Tower *towers = calloc(tower_count, sizeof(day5_Tower));
 	for (int i = max_tower_height-1; i >= 0; i--) {
 		char* line = lines[i];
 		int line_size = strlen(line);
@@ -68,98 +90,173 @@ static void *day5_parse(char **lines, int line_count)
 			if (index >= line_size) break;
 			if (line[index] == ' ') continue;
 
-			char* tower = towers->data[j];
-			tower[max_tower_height-i-1] = line[index];
+			day5_tower_push(&towers[j], line[index]);
 		}
 	}
 
 	day5_Data *data = malloc(sizeof(day5_Data));
 	data->moves  = moves;
 	data->towers = towers;
+	data->tower_count = tower_count;
+	data->total_moved = total_moved;
 	return data;
 }
 
-static void do_move(char **towers, int *tower_sizes, int from, int to)
+static day5_Tower *day5_copy_towers(day5_Data *data)
 {
-	int from_size = tower_sizes[from];
-	int to_size = tower_sizes[to];
-	towers[to][to_size] = towers[from][from_size-1];
+	day5_Tower *towers = malloc(data->tower_count * sizeof(day5_Tower));
+	for (int i = 0; i < data->tower_count; i++) {
+		day5_Tower *original = &data->towers[i];
+		towers[i].count = original->count;
+		towers[i].capacity = MAX(original->count, 1);
+		towers[i].crates = malloc(towers[i].capacity);
+		memcpy(towers[i].crates, original->crates, original->count);
+	}
+	return towers;
+}
 
-	tower_sizes[from]--;
-	tower_sizes[to]++;
+static void day5_free_towers(day5_Tower *towers, int tower_count)
+{
+	for (int i = 0; i < tower_count; i++) {
+		free(towers[i].crates);
+	}
+	free(towers);
 }
 
-static void do_move_many(char **towers, int *tower_sizes, int from, int to, int amount)
+// CrateMover 9000: moving crates one by one reverses their order,
+// so it's done as a single reversed block copy
+static void day5_move_reversed(day5_Tower *towers, Move *move)
 {
-	int from_size = tower_sizes[from];
-	int to_size = tower_sizes[to];
-	memcpy(towers[to] + to_size, towers[from] + from_size - amount, amount);
+	if (move->from == move->to) return;
 
-	tower_sizes[from] -= amount;
-	tower_sizes[to]  += amount;
+	day5_Tower *from = &towers[move->from];
+	day5_Tower *to = &towers[move->to];
+	day5_tower_reserve(to, to->count + move->amount);
+
+	char *src = from->crates + from->count - 1;
+	char *dst = to->crates + to->count;
+	for (int i = 0; i < move->amount; i++) {
+		dst[i] = src[-i];
+	}
+
+	from->count -= move->amount;
+	to->count += move->amount;
 }
 
-static char* form_answer(char **towers, int tower_count, int *tower_sizes)
+// CrateMover 9001: crates keep their order
+static void day5_move_block(day5_Tower *towers, Move *move)
 {
-	char *answer = malloc(tower_count + 1);
+	if (move->from == move->to) return;
+
+	day5_Tower *from = &towers[move->from];
+	day5_Tower *to = &towers[move->to];
+	day5_tower_reserve(to, to->count + move->amount);
+
+	memmove(to->crates + to->count, from->crates + from->count - move->amount, move->amount);
+
+	from->count -= move->amount;
+	to->count += move->amount;
+}
+
+static void day5_print_answer(day5_Tower *towers, int tower_count)
+{
+	char answer[tower_count + 1];
 	answer[tower_count] = '\0';
 	for (int i = 0; i < tower_count; i++) {
-		char *tower = towers[i];
-		answer[i] = tower[tower_sizes[i]-1];
+		day5_Tower *tower = &towers[i];
+		answer[i] = tower->count > 0 ? tower->crates[tower->count-1] : ' ';
 	}
-	return answer;
+	printf("%s\n", answer);
 }
 
-static void day5_part1(void *p)
+// Instead of simulating the towers, follow each final top position backwards
+// through the moves to find which original crate ends up there. Only one
+// position per tower is tracked per move, crates themselves are never touched.
+static void day5_trace_tops(day5_Data *data, bool keeps_order)
 {
-	day5_Data *data = p;
-	int tower_count = data->towers->count;
-	char *towers[tower_count];
-	int tower_sizes[tower_count];
+	int tower_count = data->tower_count;
+	int tower[tower_count];
+	size_t depth[tower_count]; // Counted from the top
 	for (int i = 0; i < tower_count; i++) {
-		towers[i] = calloc(26, sizeof(char));
-		memcpy(towers[i], data->towers->data[i], 26);
+		tower[i] = i;
+		depth[i] = 0;
+	}
+
+	for (int i = data->moves->count-1; i >= 0; i--) {
+		Move *move = data->moves->data[i];
+		if (move->from == move->to) continue;
 
-		tower_sizes[i] = 0;
-		for (int j = 0; j < 26; j++) {
-			if (towers[i][j] == 0) break;
-			tower_sizes[i]++;
+		for (int j = 0; j < tower_count; j++) {
+			if (tower[j] == move->to) {
+				if (depth[j] < move->amount) {
+					tower[j] = move->from;
+					if (!keeps_order) {
+						depth[j] = move->amount - 1 - depth[j];
+					}
+				} else {
+					depth[j] -= move->amount;
+				}
+			} else if (tower[j] == move->from) {
+				depth[j] += move->amount;
+			}
 		}
 	}
 
-	for (int i = 0; i < data->moves->count; i++) {
-		Move *move = data->moves->data[i];
-		for (int j = 0; j < move->amount; j++) {
-			do_move(towers, tower_sizes, move->from, move->to);
+	// Positions past the top of a tower stay past it while tracing, so an
+	// empty final tower maps to a position that never held a crate
+	char answer[tower_count + 1];
+	answer[tower_count] = '\0';
+	for (int i = 0; i < tower_count; i++) {
+		day5_Tower *original = &data->towers[tower[i]];
+		if (depth[i] < original->count) {
+			answer[i] = original->crates[original->count - 1 - depth[i]];
+		} else {
+			answer[i] = ' ';
 		}
 	}
+	printf("%s\n", answer);
+}
 
-	printf("%s\n", form_answer(towers, tower_count, tower_sizes));
+// Tracing costs O(moves * towers), simulating costs O(crates moved)
+static bool day5_should_trace(day5_Data *data)
+{
+	return data->total_moved > (u64)data->moves->count * data->tower_count;
 }
 
-static void day5_part2(void *p)
+static void day5_part1(void *p)
 {
 	day5_Data *data = p;
-	int tower_count = data->towers->count;
-	char *towers[tower_count];
-	int tower_sizes[tower_count];
-	for (int i = 0; i < tower_count; i++) {
-		towers[i] = calloc(26, sizeof(char));
-		memcpy(towers[i], data->towers->data[i], 26);
+	if (day5_should_trace(data)) {
+		day5_trace_tops(data, false);
+		return;
+	}
 
-		tower_sizes[i] = 0;
-		for (int j = 0; j < 26; j++) {
-			if (towers[i][j] == 0) break;
-			tower_sizes[i]++;
-		}
+	day5_Tower *towers = day5_copy_towers(data);
+
+	for (int i = 0; i < data->moves->count; i++) {
+		day5_move_reversed(towers, data->moves->data[i]);
 	}
 
+	day5_print_answer(towers, data->tower_count);
+	day5_free_towers(towers, data->tower_count);
+}
+
+static void day5_part2(void *p)
+{
+	day5_Data *data = p;
+	if (day5_should_trace(data)) {
+		day5_trace_tops(data, true);
+		return;
+	}
+
+	day5_Tower *towers = day5_copy_towers(data);
+
 	for (int i = 0; i < data->moves->count; i++) {
-		Move *move = data->moves->data[i];
-		do_move_many(towers, tower_sizes, move->from, move->to, move->amount);
+		day5_move_block(towers, data->moves->data[i]);
 	}
 
-	printf("%s\n", form_answer(towers, tower_count, tower_sizes));
+	day5_print_answer(towers, data->tower_count);
+	day5_free_towers(towers, data->tower_count);
 }
 
 ADD_SOLUTION(5, day5_parse, day5_part1, day5_part2);
@@ -1,55 +1,165 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
 
 #include "aoc.h"
+#include "types.h"
 
+#define PACKET_LENGTH 4
 #define MESSAGE_LENGTH 14
 
+#define DAY6_CHUNK_SIZE (64*1024)
+#define DAY6_NOT_LOWERCASE -2
+
+// Scans a lowercase datastream chunk by chunk. Every letter is a bit in a u32
+// mask and `prefix` holds the running XOR of those masks, so the XOR of a whole
+// window is prefix[i] ^ prefix[i - window]. A letter seen twice cancels itself
+// out, so the window is all distinct exactly when its popcount equals the window size.
+typedef struct {
+	size_t window;
+	u64 consumed;   // Bytes scanned in previous chunks
+	u32 *history;   // Last `window` prefix values, followed by room for one chunk
+} day6_MarkerScanner;
+
 static void *day6_parse(char **lines, int line_count)
 {
 	return lines[0];
 }
 
-static void day6_part1(void *p)
+// Returns the number of characters read until the first `window` distinct
+// characters in a row, or -1. Each character moves the window start past its
+// previous occurrence if that is still inside the window, so it's O(n) for any window size.
+static long day6_find_marker(const char *msg, size_t len, size_t window)
 {
-	char *msg = p;
-	int n = strlen(msg);
-	for (int i = 3; i < n; i++) {
-		char c1 = msg[i-3];
-		char c2 = msg[i-2];
-		char c3 = msg[i-1];
-		char c4 = msg[i-0];
-		if (c1 != c2 && c1 != c3 && c1 != c4 &&
-				c2 != c3 && c2 != c4 &&
-				c3 != c4) {
-			printf("%d\n", i+1);
-			break;
+	size_t last_seen[256];
+	for (int i = 0; i < 256; i++) {
+		last_seen[i] = 0;
+	}
+
+	// Positions are stored +1, so 0 means "not seen yet"
+	size_t window_start = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = msg[i];
+		if (last_seen[c] > window_start) {
+			window_start = last_seen[c];
+		}
+		last_seen[c] = i+1;
+
+		if (i+1 - window_start >= window) {
+			return i+1;
+		}
+	}
+	return -1;
+}
+
+static void day6_scanner_init(day6_MarkerScanner *scanner, size_t window)
+{
+	scanner->window = window;
+	scanner->consumed = 0;
+	// Zeroed history makes windows overlapping the stream start too small to match
+	scanner->history = calloc(window + DAY6_CHUNK_SIZE, sizeof(u32));
+}
+
+static void day6_scanner_free(day6_MarkerScanner *scanner)
+{
+	free(scanner->history);
+}
+
+// Plain SWAR popcount, unlike __builtin_popcount gcc can vectorize this
+static inline u32 day6_popcount32(u32 x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F;
+	return (x * 0x01010101) >> 24;
+}
+
+// Feeds up to DAY6_CHUNK_SIZE bytes. Returns the marker position counted from
+// the start of the stream, -1 if it isn't in this chunk, or DAY6_NOT_LOWERCASE
+// if the chunk has anything but lowercase letters, which the masks can't tell apart.
+static long day6_scan_chunk(day6_MarkerScanner *scanner, const char *data, size_t len)
+{
+	size_t window = scanner->window;
+	u32 *prefix = scanner->history + window;
+
+	u32 acc = prefix[-1];
+	bool lowercase = true;
+	for (size_t i = 0; i < len; i++) {
+		acc ^= 1u << (data[i] & 31);
+		prefix[i] = acc;
+		lowercase &= (u8)(data[i] - 'a') < 26;
+	}
+	if (!lowercase) {
+		return DAY6_NOT_LOWERCASE;
+	}
+
+	// Branchless pass over the whole chunk first, it vectorizes
+	u32 distinct = window;
+	u32 found = 0;
+	for (size_t i = 0; i < len; i++) {
+		found |= day6_popcount32(prefix[i] ^ prefix[i - window]) == distinct;
+	}
+
+	if (found) {
+		for (size_t i = 0; i < len; i++) {
+			if (day6_popcount32(prefix[i] ^ prefix[i - window]) == window) {
+				return scanner->consumed + i + 1;
+			}
 		}
 	}
+
+	memmove(scanner->history, scanner->history + len, window * sizeof(u32));
+	scanner->consumed += len;
+	return -1;
 }
 
-static bool is_start_of_message(char *str)
+// The letter kernel can't see more than 26 distinct letters, larger windows
+// take the general path. So does the rest of the stream from the first chunk
+// that isn't all lowercase: no marker ends before it, but one ending in it can
+// start up to `window - 1` bytes earlier.
+static long day6_find_any_marker(const char *msg, size_t len, size_t window)
 {
-	for (int i=0; i < MESSAGE_LENGTH - 1; i++) {
-		for (int j=i+1; j < MESSAGE_LENGTH; j++) {
-			if (str[i] == str[j]) {
-				return false;
+	if (window > 26) {
+		return day6_find_marker(msg, len, window);
+	}
+
+	day6_MarkerScanner scanner;
+	day6_scanner_init(&scanner, window);
+
+	long marker = -1;
+	for (size_t i = 0; i < len && marker == -1; i += DAY6_CHUNK_SIZE) {
+		marker = day6_scan_chunk(&scanner, msg + i, MIN(DAY6_CHUNK_SIZE, len - i));
+		if (marker == DAY6_NOT_LOWERCASE) {
+			size_t from = i - MIN(i, window - 1);
+			marker = day6_find_marker(msg + from, len - from, window);
+			if (marker != -1) {
+				marker += from;
 			}
+			break;
 		}
 	}
-	return true;
+
+	day6_scanner_free(&scanner);
+	return marker;
+}
+
+static void day6_part1(void *p)
+{
+	char *msg = p;
+	long marker = day6_find_any_marker(msg, strlen(msg), PACKET_LENGTH);
+	if (marker != -1) {
+		printf("%ld\n", marker);
+	}
 }
 
 static void day6_part2(void *p)
 {
 	char *msg = p;
-	int n = strlen(msg);
-	for (int i = 0; i < n-13; i++) {
-		if (is_start_of_message(msg+i)) {
-			printf("%d\n", i+14);
-			break;
-		}
+	long marker = day6_find_any_marker(msg, strlen(msg), MESSAGE_LENGTH);
+	if (marker != -1) {
+		printf("%ld\n", marker);
 	}
 }
 
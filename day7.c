@@ -1,10 +1,8 @@
-#include <limits.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/param.h>
 
 #include "aoc.h"
-#include "vec.h"
+#include "types.h"
 
 #define CD_CMD "$ cd"
 #define LS_CMD "$ ls"
@@ -12,37 +10,207 @@
 #define TOTAL_FS_SIZE 70000000
 #define UPDATE_SIZE 30000000
 
-struct TreeNode {
+#define DAY7_NO_NODE -1
+
+// Nodes live in one flat array and link to each other by index
+typedef struct {
 	char *name;
-	struct TreeNode *parent;
-	struct TreeNode **children;
-	size_t children_count;
-	size_t size;
-};
+	i32 parent;
+	i32 first_child;
+	i32 next_sibling;
+	size_t size; // For directories, total size of everything inside
+	bool is_dir;
+
+	// Size under which the directory is currently stored in `dir_sizes`
+	size_t indexed_size;
+	bool is_indexed;
+	bool is_changed;
+} day7_Node;
+
+typedef struct {
+	day7_Node *nodes;
+	size_t count;
+	size_t capacity;
+
+	// Open addressing table of node indices, keyed by (parent, name)
+	i32 *buckets;
+	size_t bucket_count;
+
+	// Sizes of all non-empty directories in ascending order, with prefix sums
+	// (dir_size_prefix[i] is the sum of the first i sizes). Deleting an empty
+	// directory frees nothing, and it would only add 0 to part 1.
+	size_t *dir_sizes;
+	size_t *dir_size_prefix;
+	size_t dir_count;
+
+	// Directories that got their first child or were resized since
+	// `dir_sizes` was last updated
+	i32 *changed;
+	size_t changed_count;
+	size_t changed_capacity;
+
+	// Working directory, kept between appends so a log can be fed in pieces
+	i32 cwd;
+} day7_Tree;
+
+static u64 day7_hash(i32 parent, const char *name)
+{
+	u64 hash = 14695981039346656037ull ^ (u64)parent;
+	for (; *name; name++) {
+		hash ^= (u8)*name;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
 
-static struct TreeNode *append_node(struct TreeNode *parent, char *child_name, size_t size)
+static void day7_map_insert(day7_Tree *tree, i32 node_idx)
 {
-	struct TreeNode *new_child = calloc(1, sizeof(struct TreeNode));
-	new_child->parent = parent;
-	new_child->name = child_name;
-	new_child->size = size;
+	day7_Node *node = &tree->nodes[node_idx];
+	size_t mask = tree->bucket_count-1;
+	size_t bucket = day7_hash(node->parent, node->name) & mask;
+	while (tree->buckets[bucket] != DAY7_NO_NODE) {
+		bucket = (bucket + 1) & mask;
+	}
+	tree->buckets[bucket] = node_idx;
+}
 
-	parent->children = realloc(parent->children, sizeof(struct TreeNode*)*(parent->children_count+1));
-	parent->children[parent->children_count] = new_child;
-	parent->children_count++;
-	return new_child;
+static void day7_map_grow(day7_Tree *tree)
+{
+	free(tree->buckets);
+	tree->bucket_count *= 2;
+	tree->buckets = malloc(tree->bucket_count * sizeof(i32));
+	memset(tree->buckets, 0xff, tree->bucket_count * sizeof(i32));
+	// Root has no parent and is never looked up by name
+	for (size_t i = 1; i < tree->count; i++) {
+		day7_map_insert(tree, i);
+	}
 }
 
-static struct TreeNode *get_or_append_child(struct TreeNode *parent, char *child_name)
+static i32 day7_map_find(day7_Tree *tree, i32 parent, const char *name)
 {
-	for (int i = 0; i < parent->children_count; i++) {
-		struct TreeNode *child = parent->children[i];
-		if (strcmp(child->name, child_name) == 0) {
-			return child;
+	size_t mask = tree->bucket_count-1;
+	size_t bucket = day7_hash(parent, name) & mask;
+	while (tree->buckets[bucket] != DAY7_NO_NODE) {
+		day7_Node *node = &tree->nodes[tree->buckets[bucket]];
+		if (node->parent == parent && strcmp(node->name, name) == 0) {
+			return tree->buckets[bucket];
 		}
+		bucket = (bucket + 1) & mask;
 	}
+	return DAY7_NO_NODE;
+}
 
-	return append_node(parent, child_name, -1);
+static void day7_mark_changed(day7_Tree *tree, i32 dir)
+{
+	if (tree->nodes[dir].is_changed) return;
+
+	if (tree->changed_count >= tree->changed_capacity) {
+		tree->changed_capacity *= 2;
+		tree->changed = realloc(tree->changed, tree->changed_capacity * sizeof(i32));
+	}
+	tree->changed[tree->changed_count++] = dir;
+	tree->nodes[dir].is_changed = true;
+}
+
+static day7_Tree *day7_tree_malloc()
+{
+	day7_Tree *tree = malloc(sizeof(day7_Tree));
+	tree->capacity = 64;
+	tree->nodes = malloc(tree->capacity * sizeof(day7_Node));
+	tree->bucket_count = 128;
+	tree->buckets = malloc(tree->bucket_count * sizeof(i32));
+	memset(tree->buckets, 0xff, tree->bucket_count * sizeof(i32));
+
+	tree->count = 1;
+	tree->nodes[0] = (day7_Node){
+		.name = "/",
+		.parent = DAY7_NO_NODE,
+		.first_child = DAY7_NO_NODE,
+		.next_sibling = DAY7_NO_NODE,
+		.size = 0,
+		.is_dir = true
+	};
+	tree->cwd = 0;
+
+	tree->dir_sizes = NULL;
+	tree->dir_size_prefix = NULL;
+	tree->dir_count = 0;
+
+	tree->changed_capacity = 64;
+	tree->changed = malloc(tree->changed_capacity * sizeof(i32));
+	tree->changed_count = 0;
+	return tree;
+}
+
+static i32 append_node(day7_Tree *tree, i32 parent, char *child_name, size_t size, bool is_dir)
+{
+	if (tree->count >= tree->capacity) {
+		tree->capacity *= 2;
+		tree->nodes = realloc(tree->nodes, tree->capacity * sizeof(day7_Node));
+	}
+
+	if (tree->nodes[parent].first_child == DAY7_NO_NODE) {
+		day7_mark_changed(tree, parent);
+	}
+
+	i32 child_idx = tree->count++;
+	tree->nodes[child_idx] = (day7_Node){
+		.name = child_name,
+		.parent = parent,
+		.first_child = DAY7_NO_NODE,
+		.next_sibling = tree->nodes[parent].first_child,
+		.size = size,
+		.is_dir = is_dir
+	};
+	tree->nodes[parent].first_child = child_idx;
+
+	// Keep load factor under 1/2
+	if (tree->count * 2 > tree->bucket_count) {
+		day7_map_grow(tree);
+	} else {
+		day7_map_insert(tree, child_idx);
+	}
+	return child_idx;
+}
+
+static i32 get_or_append_child(day7_Tree *tree, i32 parent, char *child_name)
+{
+	i32 child = day7_map_find(tree, parent, child_name);
+	if (child != DAY7_NO_NODE) {
+		if (!tree->nodes[child].is_dir) {
+			fprintf(stderr, "'%s' is listed as a file, not a directory\n", child_name);
+			abort();
+		}
+		return child;
+	}
+
+	return append_node(tree, parent, child_name, 0, true);
+}
+
+// Directory sizes are kept up to date while parsing, by adding every file
+// to all of its ancestors. A file that was already listed before only adds
+// the difference to its old size, so listing a directory again is a no-op.
+static void day7_append_file(day7_Tree *tree, i32 parent, char *file_name, size_t size)
+{
+	size_t added = size;
+	i32 file = day7_map_find(tree, parent, file_name);
+	if (file == DAY7_NO_NODE) {
+		append_node(tree, parent, file_name, size, false);
+	} else {
+		if (tree->nodes[file].is_dir) {
+			fprintf(stderr, "'%s' is listed as a directory, not a file\n", file_name);
+			abort();
+		}
+		// Wraps around for a file that shrank, which still sums up right
+		added = size - tree->nodes[file].size;
+		tree->nodes[file].size = size;
+		if (added == 0) return;
+	}
+
+	for (i32 dir = parent; dir != DAY7_NO_NODE; dir = tree->nodes[dir].parent) {
+		tree->nodes[dir].size += added;
+		day7_mark_changed(tree, dir);
+	}
 }
 
 static int find_char(char *haystack, char needle) {
@@ -55,112 +223,167 @@ static int find_char(char *haystack, char needle) {
 	return -1;
 }
 
-static void populate_directory_sizes(struct TreeNode *start)
+static int day7_compare_size(const void *a, const void *b)
 {
-	struct TreeNode *current = start;
-	while (current != start->parent) {
-		bool is_explored = true;
-		for (int i = 0; i < current->children_count; i++) {
-			struct TreeNode *child = current->children[i];
-			if (child->size == -1) {
-				current = child;
-				is_explored = false;
-				break;
-			}
+	size_t A = *(const size_t*)a, B = *(const size_t*)b;
+	return (A > B) - (A < B);
+}
+
+// Brings `dir_sizes` up to date with the changed directories. Their old
+// sizes are dropped and their new sizes merged in, in one linear pass, so
+// only the changed directories get sorted.
+static void day7_update_size_index(day7_Tree *tree)
+{
+	size_t changed_count = tree->changed_count;
+	size_t *old_sizes = malloc(changed_count * sizeof(size_t));
+	size_t *new_sizes = malloc(changed_count * sizeof(size_t));
+	size_t old_count = 0, new_count = 0;
+	for (size_t i = 0; i < changed_count; i++) {
+		day7_Node *dir = &tree->nodes[tree->changed[i]];
+		dir->is_changed = false;
+		if (dir->first_child == DAY7_NO_NODE) continue;
+
+		if (dir->is_indexed) {
+			old_sizes[old_count++] = dir->indexed_size;
 		}
+		new_sizes[new_count++] = dir->size;
 
-		if (is_explored) {
-			current->size = 0;
-			for (int i = 0; i < current->children_count; i++) {
-				current->size += current->children[i]->size;
-			}
+		dir->indexed_size = dir->size;
+		dir->is_indexed = true;
+	}
+	qsort(old_sizes, old_count, sizeof(size_t), day7_compare_size);
+	qsort(new_sizes, new_count, sizeof(size_t), day7_compare_size);
 
-			current = current->parent;
+	size_t dir_count = tree->dir_count - old_count + new_count;
+	size_t *dir_sizes = malloc(dir_count * sizeof(size_t));
+	size_t old_idx = 0, new_idx = 0, count = 0;
+	for (size_t i = 0; i < tree->dir_count; i++) {
+		size_t size = tree->dir_sizes[i];
+		if (old_idx < old_count && old_sizes[old_idx] == size) {
+			old_idx++;
+			continue;
+		}
+		while (new_idx < new_count && new_sizes[new_idx] < size) {
+			dir_sizes[count++] = new_sizes[new_idx++];
 		}
+		dir_sizes[count++] = size;
 	}
+	while (new_idx < new_count) {
+		dir_sizes[count++] = new_sizes[new_idx++];
+	}
+
+	free(tree->dir_sizes);
+	free(tree->dir_size_prefix);
+	tree->dir_sizes = dir_sizes;
+	tree->dir_count = dir_count;
+	tree->dir_size_prefix = malloc((dir_count+1) * sizeof(size_t));
+	tree->dir_size_prefix[0] = 0;
+	for (size_t i = 0; i < dir_count; i++) {
+		tree->dir_size_prefix[i+1] = tree->dir_size_prefix[i] + dir_sizes[i];
+	}
+
+	tree->changed_count = 0;
+	free(old_sizes);
+	free(new_sizes);
 }
 
-static void *day7_parse(char **lines, int line_count)
+// Index of the first directory in `dir_sizes` with size >= `size`
+static size_t day7_lower_bound(day7_Tree *tree, size_t size)
 {
-	struct TreeNode *root = calloc(1, sizeof(struct TreeNode));
-	root->name = "/";
-
-	struct TreeNode *current = root;
-	for (int i = 0; i < line_count; i++) {
-		char *line = lines[i];
-		if (strncmp(line, CD_CMD, sizeof(CD_CMD)-1) == 0) {
-			char *dir_name = line + sizeof(CD_CMD);
-			if (strncmp(dir_name, "/", 1) == 0) {
-				current = root;
-			} else if (strncmp(dir_name, "..", 2) == 0) {
-				current = current->parent;
-			} else {
-				current = get_or_append_child(current, dir_name);
-			}
-		} else if (strncmp(line, LS_CMD, sizeof(LS_CMD)) == 0) {
-			continue;
+	size_t lo = 0, hi = tree->dir_count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (tree->dir_sizes[mid] < size) {
+			lo = mid + 1;
 		} else {
-			if (strncmp(line, "dir", 3) == 0) {
-				char *dir_name = line + 4;
-				get_or_append_child(current, dir_name);
-			} else {
-				int sep = find_char(line, ' ');
-				char *child_name = line + sep + 1;
-				line[sep] = '\0';
-				int size = strtol(line, NULL, 10);
-				line[sep] = ' ';
-				append_node(current, child_name, size);
-			}
+			hi = mid;
 		}
 	}
+	return lo;
+}
 
-	return root;
+static size_t day7_sum_dirs_at_most(day7_Tree *tree, size_t limit)
+{
+	return tree->dir_size_prefix[day7_lower_bound(tree, limit+1)];
 }
 
-static void day7_part1(void *p)
+// Returns false if there is no such directory
+static bool day7_smallest_dir_at_least(day7_Tree *tree, size_t size, size_t *result)
 {
-	struct TreeNode *root = p;
+	size_t idx = day7_lower_bound(tree, size);
+	if (idx == tree->dir_count) return false;
 
-	populate_directory_sizes(root);
+	*result = tree->dir_sizes[idx];
+	return true;
+}
 
-	int result = 0;
-	Vec *stack = vec_malloc(10);
-	vec_push(stack, root);
-	while (stack->count > 0) {
-		struct TreeNode *node = vec_pop(stack);
-		if (node->size <= 100000 && node->children_count > 0) {
-			result += node->size;
+static void day7_apply_line(day7_Tree *tree, char *line)
+{
+	if (strncmp(line, CD_CMD, sizeof(CD_CMD)-1) == 0) {
+		char *dir_name = line + sizeof(CD_CMD);
+		if (strncmp(dir_name, "/", 1) == 0) {
+			tree->cwd = 0;
+		} else if (strncmp(dir_name, "..", 2) == 0) {
+			tree->cwd = tree->nodes[tree->cwd].parent;
+		} else {
+			tree->cwd = get_or_append_child(tree, tree->cwd, dir_name);
 		}
-		for (int i = 0; i < node->children_count; i++) {
-			vec_push(stack, node->children[i]);
+	} else if (strncmp(line, LS_CMD, sizeof(LS_CMD)) == 0) {
+		return;
+	} else {
+		if (strncmp(line, "dir", 3) == 0) {
+			char *dir_name = line + 4;
+			get_or_append_child(tree, tree->cwd, dir_name);
+		} else {
+			int sep = find_char(line, ' ');
+			char *child_name = line + sep + 1;
+			line[sep] = '\0';
+			int size = strtol(line, NULL, 10);
+			line[sep] = ' ';
+			day7_append_file(tree, tree->cwd, child_name, size);
 		}
 	}
+}
 
-	printf("%d\n", result);
+// Applies more lines of a terminal log to an already parsed tree, continuing
+// from the directory the previous lines left off in. Node names point into
+// `lines`, so they must outlive the tree.
+static void day7_append_lines(day7_Tree *tree, char **lines, int line_count)
+{
+	for (int i = 0; i < line_count; i++) {
+		day7_apply_line(tree, lines[i]);
+	}
+	day7_update_size_index(tree);
 }
 
-static void day7_part2(void *p)
+static void *day7_parse(char **lines, int line_count)
 {
-	struct TreeNode *root = p;
+	day7_Tree *tree = day7_tree_malloc();
+	day7_append_lines(tree, lines, line_count);
+	return tree;
+}
+
+static void day7_part1(void *p)
+{
+	day7_Tree *tree = p;
+	printf("%lu\n", day7_sum_dirs_at_most(tree, 100000));
+}
 
-	populate_directory_sizes(root);
+static void day7_part2(void *p)
+{
+	day7_Tree *tree = p;
 
-	int needed_space = UPDATE_SIZE - (TOTAL_FS_SIZE - root->size);
+	// Used space may exceed the disk, so no unsigned free space in between
+	size_t used_space = tree->nodes[0].size;
+	size_t max_used_space = TOTAL_FS_SIZE - UPDATE_SIZE;
+	size_t needed_space = used_space > max_used_space ? used_space - max_used_space : 0;
 
-	int result = INT_MAX;
-	Vec *stack = vec_malloc(10);
-	vec_push(stack, root);
-	while (stack->count > 0) {
-		struct TreeNode *node = vec_pop(stack);
-		if (node->size >= needed_space && node->children_count > 0) {
-			result = MIN(result, node->size);
-		}
-		for (int i = 0; i < node->children_count; i++) {
-			vec_push(stack, node->children[i]);
-		}
+	size_t result;
+	if (day7_smallest_dir_at_least(tree, needed_space, &result)) {
+		printf("%lu\n", result);
+	} else {
+		fprintf(stderr, "No directory frees up enough space\n");
 	}
-
-	printf("%d\n", result);
 }
 
 ADD_SOLUTION(7, day7_parse, day7_part1, day7_part2);
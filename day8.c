@@ -3,117 +3,298 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/param.h>
 
 #include "aoc.h"
 
+#define DAY8_MAX_HEIGHT 9
+// Tile size for transposing, and how many columns are swept together
+#define DAY8_TILE 64
+#define DAY8_COLUMN_BLOCK 1024
+
 typedef struct {
-	uint8_t **data;
+	uint8_t *data;       // Row-major, indexed by y * width + x
+	uint8_t *transposed; // Column-major copy, indexed by x * height + y
 	size_t width, height;
+
+	// Filled by day8_analyze, indexed by y * width + x
+	bool analyzed;
+	uint8_t *visible;
+	uint64_t *score;
+	size_t visible_count;
+	uint64_t best_score;
 } day8_Map;
 
+// Copies a rows x cols grid into a cols x rows one, tile by tile so that
+// both reads and writes stay in cache
+static void day8_transpose(const uint8_t *src, uint8_t *dst, size_t rows, size_t cols)
+{
+	for (size_t ty = 0; ty < rows; ty += DAY8_TILE) {
+		for (size_t tx = 0; tx < cols; tx += DAY8_TILE) {
+			size_t y1 = MIN(ty + DAY8_TILE, rows);
+			size_t x1 = MIN(tx + DAY8_TILE, cols);
+			for (size_t y = ty; y < y1; y++) {
+				for (size_t x = tx; x < x1; x++) {
+					dst[x * rows + y] = src[y * cols + x];
+				}
+			}
+		}
+	}
+}
+
 static void *day8_parse(char **lines, int line_count)
 {
 	day8_Map *map = malloc(sizeof(day8_Map));
 	map->height = line_count;
 	map->width = strlen(lines[0]);
-	map->data = malloc(map->height*sizeof(uint8_t*));
+	map->data = malloc(map->width * map->height * sizeof(uint8_t));
 	for (int y = 0; y < map->height; y++) {
-		map->data[y] = malloc(map->width*sizeof(uint8_t));
 		for (int x = 0; x < map->width; x++) {
-			map->data[y][x] = lines[y][x] - '0';
+			map->data[y * map->width + x] = lines[y][x] - '0';
 		}
 	}
+	map->transposed = malloc(map->width * map->height * sizeof(uint8_t));
+	day8_transpose(map->data, map->transposed, map->height, map->width);
+	map->analyzed = false;
 	return map;
 }
 
-static bool is_visible_horizontal(day8_Map *map, uint8_t value, int x0, int x1, int y)
+// Sweeps columns [x0, x1), at most DAY8_COLUMN_BLOCK wide, of a row-major grid downwards and then upwards.
+// Every step handles a whole row of columns with unit-stride loops, which gcc
+// vectorizes. A tree is visible if it's taller than the running maximum of its
+// column. `blocker[h]` holds the nearest row seen so far with a tree of height
+// >= h, which gives the viewing distance without scanning.
+// `distance` receives the product of the up and down viewing distances.
+static void day8_sweep_columns(const uint8_t *restrict grid, size_t rows, size_t cols, size_t x0, size_t x1, uint8_t *restrict visible, uint32_t *restrict distance)
 {
-	for (int xi = x0; xi < x1; xi++) {
-		if (map->data[y][xi] >= value) return false;
+	size_t n = x1 - x0;
+	uint8_t *restrict max_height = malloc(n * sizeof(uint8_t)); // Max height + 1, so 0 means none
+	uint32_t (*restrict blocker)[DAY8_COLUMN_BLOCK] = malloc((DAY8_MAX_HEIGHT+1) * sizeof(*blocker));
+
+	memset(max_height, 0, n);
+	memset(blocker, 0, (DAY8_MAX_HEIGHT+1) * sizeof(*blocker));
+	for (uint32_t y = 0; y < rows; y++) {
+		const uint8_t *restrict row = grid + y * cols + x0;
+		uint8_t *restrict row_visible = visible + y * cols + x0;
+		uint32_t *restrict row_distance = distance + y * cols + x0;
+
+		for (size_t x = 0; x < n; x++) {
+			row_visible[x] = row[x] >= max_height[x];
+			max_height[x] = MAX(max_height[x], row[x] + 1);
+		}
+		for (size_t x = 0; x < n; x++) {
+			uint32_t nearest = 0;
+			#pragma GCC unroll 16
+			for (uint32_t h = 0; h <= DAY8_MAX_HEIGHT; h++) {
+				// Branchless selects, so the loop over x vectorizes
+				uint32_t b = blocker[h][x];
+				uint32_t is_height = -(uint32_t)(row[x] == h);
+				uint32_t is_blocking = -(uint32_t)(row[x] >= h);
+				nearest |= b & is_height;
+				blocker[h][x] = (y & is_blocking) | (b & ~is_blocking);
+			}
+			row_distance[x] = y - nearest;
+		}
 	}
-	return true;
-}
 
-static bool is_visible_vertical(day8_Map *map, uint8_t value, int x, int y0, int y1)
-{
-	for (int yi = y0; yi < y1; yi++) {
-		if (map->data[yi][x] >= value) return false;
+	memset(max_height, 0, n);
+	for (size_t h = 0; h <= DAY8_MAX_HEIGHT; h++) {
+		for (size_t x = 0; x < n; x++) {
+			blocker[h][x] = rows-1;
+		}
 	}
-	return true;
-}
+	for (uint32_t y = rows; y-- > 0;) {
+		const uint8_t *restrict row = grid + y * cols + x0;
+		uint8_t *restrict row_visible = visible + y * cols + x0;
+		uint32_t *restrict row_distance = distance + y * cols + x0;
 
-static bool is_visible(day8_Map *map, int x, int y) {
-	uint8_t current = map->data[y][x];
-	return is_visible_horizontal (map, current, x+1, map->width, y) ||
-					is_visible_horizontal(map, current, 0, x, y) ||
-					is_visible_vertical  (map, current, x, y+1, map->height) ||
-					is_visible_vertical  (map, current, x, 0, y);
+		for (size_t x = 0; x < n; x++) {
+			row_visible[x] |= row[x] >= max_height[x];
+			max_height[x] = MAX(max_height[x], row[x] + 1);
+		}
+		for (size_t x = 0; x < n; x++) {
+			uint32_t nearest = 0;
+			#pragma GCC unroll 16
+			for (uint32_t h = 0; h <= DAY8_MAX_HEIGHT; h++) {
+				// Branchless selects, so the loop over x vectorizes
+				uint32_t b = blocker[h][x];
+				uint32_t is_height = -(uint32_t)(row[x] == h);
+				uint32_t is_blocking = -(uint32_t)(row[x] >= h);
+				nearest |= b & is_height;
+				blocker[h][x] = (y & is_blocking) | (b & ~is_blocking);
+			}
+			row_distance[x] *= nearest - y;
+		}
+	}
+
+	free(max_height);
+	free(blocker);
 }
 
-static int get_horizontal_edge(day8_Map *map, uint8_t value, int x0, int x1, int y)
+// State shared by the analysis threads. Work is handed out through atomic
+// counters: first column blocks of both grids, then bands of tile rows
+// to merge the two results.
+typedef struct {
+	day8_Map *map;
+	uint8_t *visible, *visible_t;
+	uint32_t *distance, *distance_t;
+
+	size_t block_count, block_count_t;
+	size_t next_block;
+
+	size_t band_count;
+	size_t next_band;
+} day8_Analysis;
+
+typedef struct {
+	day8_Analysis *analysis;
+	pthread_t thread;
+	size_t visible_count;
+	uint64_t best_score;
+} day8_Worker;
+
+static void *day8_sweep_worker(void *p)
 {
-	if (x0 <= x1) {
-		for (int xi = x0; xi <= x1; xi++) {
-			if (map->data[y][xi] >= value) return xi;
+	day8_Worker *worker = p;
+	day8_Analysis *analysis = worker->analysis;
+	day8_Map *map = analysis->map;
+
+	size_t total = analysis->block_count + analysis->block_count_t;
+	size_t block;
+	while ((block = __atomic_fetch_add(&analysis->next_block, 1, __ATOMIC_RELAXED)) < total) {
+		// Columns of the map are swept directly, rows are swept as the
+		// columns of the transposed copy
+		if (block < analysis->block_count) {
+			size_t x0 = block * DAY8_COLUMN_BLOCK;
+			size_t x1 = MIN(x0 + DAY8_COLUMN_BLOCK, map->width);
+			day8_sweep_columns(map->data, map->height, map->width, x0, x1, analysis->visible, analysis->distance);
+		} else {
+			size_t y0 = (block - analysis->block_count) * DAY8_COLUMN_BLOCK;
+			size_t y1 = MIN(y0 + DAY8_COLUMN_BLOCK, map->height);
+			day8_sweep_columns(map->transposed, map->width, map->height, y0, y1, analysis->visible_t, analysis->distance_t);
 		}
-	} else {
-		for (int xi = x0; xi >= x1; xi--) {
-			if (map->data[y][xi] >= value) return xi;
+	}
+	return NULL;
+}
+
+static void *day8_merge_worker(void *p)
+{
+	day8_Worker *worker = p;
+	day8_Analysis *analysis = worker->analysis;
+	day8_Map *map = analysis->map;
+	size_t width = map->width, height = map->height;
+
+	size_t visible_count = 0;
+	uint64_t best_score = 0;
+	size_t band;
+	while ((band = __atomic_fetch_add(&analysis->next_band, 1, __ATOMIC_RELAXED)) < analysis->band_count) {
+		size_t ty = band * DAY8_TILE;
+		size_t y1 = MIN(ty + DAY8_TILE, height);
+		for (size_t tx = 0; tx < width; tx += DAY8_TILE) {
+			size_t x1 = MIN(tx + DAY8_TILE, width);
+			for (size_t y = ty; y < y1; y++) {
+				for (size_t x = tx; x < x1; x++) {
+					size_t idx = y * width + x;
+					size_t idx_t = x * height + y;
+					uint8_t visible = analysis->visible[idx] | analysis->visible_t[idx_t];
+					uint64_t score = (uint64_t)analysis->distance[idx] * analysis->distance_t[idx_t];
+					map->visible[idx] = visible;
+					map->score[idx] = score;
+					visible_count += visible;
+					best_score = MAX(best_score, score);
+				}
+			}
 		}
 	}
-	return x1;
+
+	worker->visible_count = visible_count;
+	worker->best_score = best_score;
+	return NULL;
 }
 
-static int get_vertical_edge(day8_Map *map, uint8_t value, int x, int y0, int y1)
+// Blocks and bands are claimed through the counters in day8_Analysis, so a
+// worker left without a thread usually finds none left when it's run here
+// after worker 0. It still has to run: the merge sets its totals.
+static void day8_run_workers(day8_Worker *workers, size_t count, void *(*worker_cb)(void*))
 {
-	if (y0 <= y1) {
-		for (int yi = y0; yi <= y1; yi++) {
-			if (map->data[yi][x] >= value) return yi;
+	bool started[count];
+	for (size_t i = 1; i < count; i++) {
+		started[i] = pthread_create(&workers[i].thread, NULL, worker_cb, &workers[i]) == 0;
+	}
+	worker_cb(&workers[0]);
+	for (size_t i = 1; i < count; i++) {
+		if (!started[i]) {
+			worker_cb(&workers[i]);
 		}
-	} else {
-		for (int yi = y0; yi >= y1; yi--) {
-			if (map->data[yi][x] >= value) return yi;
+	}
+	for (size_t i = 1; i < count; i++) {
+		if (started[i]) {
+			pthread_join(workers[i].thread, NULL);
 		}
 	}
-	return y1;
 }
 
-static int get_score(day8_Map *map, int x, int y) {
-	uint8_t value = map->data[y][x];
-	int right_edge  = get_horizontal_edge(map, value, x+1, map->width-1, y);
-	int left_edge   = get_horizontal_edge(map, value, x-1, 0  , y);
-	int bottom_edge = get_vertical_edge  (map, value, x, y+1, map->height-1);
-	int top_edge    = get_vertical_edge  (map, value, x, y-1, 0);
-	return (right_edge - x) * (x - left_edge) * (bottom_edge - y) * (y - top_edge);
+static void day8_analyze(day8_Map *map)
+{
+	if (map->analyzed) return;
+
+	size_t width = map->width, height = map->height;
+	size_t cell_count = width * height;
+
+	day8_Analysis analysis = {
+		.map = map,
+		.visible = malloc(cell_count * sizeof(uint8_t)),
+		.distance = malloc(cell_count * sizeof(uint32_t)),
+		.visible_t = malloc(cell_count * sizeof(uint8_t)),
+		.distance_t = malloc(cell_count * sizeof(uint32_t)),
+		.block_count = (width + DAY8_COLUMN_BLOCK - 1) / DAY8_COLUMN_BLOCK,
+		.block_count_t = (height + DAY8_COLUMN_BLOCK - 1) / DAY8_COLUMN_BLOCK,
+		.next_block = 0,
+		.band_count = (height + DAY8_TILE - 1) / DAY8_TILE,
+		.next_band = 0
+	};
+	map->visible = malloc(cell_count * sizeof(uint8_t));
+	map->score = malloc(cell_count * sizeof(uint64_t));
+
+	// Column blocks are the coarsest unit of work, no point in having more threads
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t thread_count = MAX(1, MIN(cpu_count, analysis.block_count + analysis.block_count_t));
+	day8_Worker workers[thread_count];
+	for (size_t i = 0; i < thread_count; i++) {
+		workers[i].analysis = &analysis;
+	}
+
+	day8_run_workers(workers, thread_count, day8_sweep_worker);
+	day8_run_workers(workers, thread_count, day8_merge_worker);
+
+	map->visible_count = 0;
+	map->best_score = 0;
+	for (size_t i = 0; i < thread_count; i++) {
+		map->visible_count += workers[i].visible_count;
+		map->best_score = MAX(map->best_score, workers[i].best_score);
+	}
+
+	free(analysis.visible);
+	free(analysis.distance);
+	free(analysis.visible_t);
+	free(analysis.distance_t);
+	map->analyzed = true;
 }
 
 static void day8_part1(void *p)
 {
 	day8_Map *map = p;
-
-	int result = map->height * map->width - (map->height-2) * (map->width-2);
-	for (int y = 1; y < map->height-1; y++) {
-		for (int x = 1; x < map->width-1; x++) {
-			result += is_visible(map, x, y);
-		}
-	}
-
-	printf("%d\n", result);
+	day8_analyze(map);
+	printf("%zu\n", map->visible_count);
 }
 
 static void day8_part2(void *p)
 {
 	day8_Map *map = p;
-
-	int result = 0;
-	for (int y = 1; y < map->height-1; y++) {
-		for (int x = 1; x < map->width-1; x++) {
-			result = MAX(result, get_score(map, x, y));
-		}
-	}
-
-	printf("%d\n", result);
+	day8_analyze(map);
+	printf("%lu\n", map->best_score);
 }
 
 ADD_SOLUTION(8, day8_parse, day8_part1, day8_part2);
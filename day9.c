@@ -4,6 +4,7 @@
 #include <sys/param.h>
 
 #include "aoc.h"
+#include "types.h"
 #include "vec2.h"
 
 typedef enum {
@@ -55,37 +56,64 @@ static int sign(int x)
 	return x > 0 ? 1 : -1;
 }
 
-static void get_bounding_box(day9_Data *moves, int *ox, int *oy, int *width, int *height)
+// Open addressing hash set of visited positions, so memory only depends on
+// how many cells the tail actually visits
+typedef struct {
+	u64 *keys; // 0 marks an empty slot
+	size_t capacity;
+	size_t count;
+} day9_PointSet;
+
+// Offsetting coordinates keeps (0, 0) away from the empty key
+static inline u64 day9_point_key(vec2 p)
 {
-	int minx = 0, maxx = 0;
-	int miny = 0, maxy = 0;
-	int x = 0, y = 0;
-	for (int i = 0; i < moves->count; i++) {
-		RopeMove *move = &moves->moves[i];
-		switch (move->dir) {
-			case MOVE_DIR_UP:
-				y -= move->count;
-				break;
-			case MOVE_DIR_DOWN:
-				y += move->count;
-				break;
-			case MOVE_DIR_LEFT:
-				x -= move->count;
-				break;
-			case MOVE_DIR_RIGHT:
-				x += move->count;
-				break;
+	return ((u64)((u32)p.x ^ 0x80000000u) << 32) | ((u32)p.y ^ 0x80000000u);
+}
+
+static inline size_t day9_point_slot(u64 key, size_t capacity)
+{
+	return (key * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctzll(capacity));
+}
+
+static void day9_point_set_init(day9_PointSet *set, size_t capacity)
+{
+	set->capacity = capacity;
+	set->count = 0;
+	set->keys = calloc(capacity, sizeof(u64));
+}
+
+static void day9_point_set_insert_key(day9_PointSet *set, u64 key)
+{
+	size_t mask = set->capacity-1;
+	size_t slot = day9_point_slot(key, set->capacity);
+	while (set->keys[slot] != 0) {
+		if (set->keys[slot] == key) return;
+		slot = (slot + 1) & mask;
+	}
+	set->keys[slot] = key;
+	set->count++;
+}
+
+static void day9_point_set_grow(day9_PointSet *set)
+{
+	u64 *old_keys = set->keys;
+	size_t old_capacity = set->capacity;
+	day9_point_set_init(set, old_capacity * 2);
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (old_keys[i] != 0) {
+			day9_point_set_insert_key(set, old_keys[i]);
 		}
-		minx = MIN(x, minx);
-		maxx = MAX(x, maxx);
-		miny = MIN(y, miny);
-		maxy = MAX(y, maxy);
 	}
+	free(old_keys);
+}
 
-	*ox = -minx;
-	*oy = -miny;
-	*width = maxx - minx + 1;
-	*height = maxy - miny + 1;
+static void day9_point_set_insert(day9_PointSet *set, vec2 p)
+{
+	// Keep load factor under 1/2
+	if ((set->count+1) * 2 > set->capacity) {
+		day9_point_set_grow(set);
+	}
+	day9_point_set_insert_key(set, day9_point_key(p));
 }
 
 static void get_move_direction(MOVE_DIR dir, int *dx, int *dy)
@@ -122,92 +150,72 @@ static void follow_point(vec2 *tail, vec2 *head)
 	}
 }
 
-static void day9_part1(void *p)
+// Simulates a rope of `knot_count` knots (head included) and returns how many
+// positions the tail visited. A step stops propagating at the first knot that
+// doesn't move, since no knot behind it can move either. If a step moved every
+// knot by exactly the head's direction, each knot had to be 2 cells straight
+// behind its leader. Now they are all 1 cell behind, so the rope is a straight
+// line being dragged, and the rest of the move shifts every knot at once.
+static size_t day9_simulate_rope(day9_Data *moves, int knot_count)
 {
-	day9_Data *moves = p;
+	day9_PointSet visited;
+	day9_point_set_init(&visited, 1024);
 
-	int ox, oy, width, height;
-	get_bounding_box(moves, &ox, &oy, &width, &height);
+	vec2 *rope = calloc(knot_count, sizeof(vec2));
+	vec2 *tail = &rope[knot_count-1];
+	day9_point_set_insert(&visited, *tail);
 
-	bool map[width][height];
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			map[x][y] = false;
-		}
-	}
-	map[ox][oy] = true;
-
-	vec2 head = { 0, 0 };
-	vec2 tail = { 0, 0 };
 	for (int i = 0; i < moves->count; i++) {
 		RopeMove *move = &moves->moves[i];
 		int dx = 0, dy = 0;
 		get_move_direction(move->dir, &dx, &dy);
-		for (int j = 0; j < move->count; j++) {
-			head.x += dx;
-			head.y += dy;
 
-			follow_point(&tail, &head);
-			map[tail.x+ox][tail.y+oy] = true;
-		}
-	}
+		int step = 0;
+		while (step < move->count) {
+			rope[0].x += dx;
+			rope[0].y += dy;
+			step++;
 
-	int result = 0;
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			result += map[x][y];
-		}
-	}
-	printf("%d\n", result);
-}
-
-static void day9_part2(void *p)
-{
-	day9_Data *moves = p;
-
-	int ox, oy, width, height;
-	get_bounding_box(moves, &ox, &oy, &width, &height);
-
-	bool map[width][height];
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			map[x][y] = false;
-		}
-	}
-	map[ox][oy] = true;
-
-	int rope_size = 10;
-	vec2 rope[rope_size];
-	for (int i = 0; i < rope_size; i++) {
-		rope[i].x = 0;
-		rope[i].y = 0;
-	}
-
-	for (int i = 0; i < moves->count; i++) {
-		RopeMove *move = &moves->moves[i];
-		int dx = 0, dy = 0;
-		get_move_direction(move->dir, &dx, &dy);
-		for (int _ = 0; _ < move->count; _++) {
-			vec2 *head = &rope[0];
-			head->x += dx;
-			head->y += dy;
-
-			for (int j = 1; j < rope_size; j++) {
+			bool is_dragged = true;
+			int j = 1;
+			for (; j < knot_count; j++) {
+				vec2 before = rope[j];
 				follow_point(&rope[j], &rope[j-1]);
+				if (vec2_eq2(before, rope[j])) break;
+				is_dragged &= rope[j].x - before.x == dx && rope[j].y - before.y == dy;
 			}
 
-			vec2 *tail = &rope[rope_size-1];
-			map[tail->x+ox][tail->y+oy] = true;
+			if (j < knot_count) continue;
+			day9_point_set_insert(&visited, *tail);
+
+			if (is_dragged) {
+				int remaining = move->count - step;
+				for (int k = 1; k <= remaining; k++) {
+					day9_point_set_insert(&visited, (vec2)VEC2(tail->x + k*dx, tail->y + k*dy));
+				}
+				for (int k = 0; k < knot_count; k++) {
+					rope[k].x += remaining*dx;
+					rope[k].y += remaining*dy;
+				}
+				step = move->count;
+			}
 		}
 	}
 
-	int result = 0;
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			result += map[x][y];
-		}
-	}
-	printf("%d\n", result);
+	size_t result = visited.count;
+	free(rope);
+	free(visited.keys);
+	return result;
+}
+
+static void day9_part1(void *p)
+{
+	printf("%zu\n", day9_simulate_rope(p, 2));
+}
+
+static void day9_part2(void *p)
+{
+	printf("%zu\n", day9_simulate_rope(p, 10));
 }
 
 ADD_SOLUTION(9, day9_parse, day9_part1, day9_part2);